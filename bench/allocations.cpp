@@ -0,0 +1,48 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Replaces the global operator new to count its calls for bench/suite.
+ * It lives in a translation unit of its own, so that the compiler cannot
+ * inline the replacement operators into the callers and then mistake the
+ * free() in operator delete for the release of a new'ed pointer.
+ */
+
+#include <new>
+#include <stdlib.h>
+
+size_t allocations = 0;
+
+#if __cplusplus >= 201103L
+#define NEW_THROWS
+#else
+#define NEW_THROWS throw(std::bad_alloc)
+#endif
+
+void* operator new(size_t n) NEW_THROWS {
+  ++allocations;
+  void *p = malloc(n ? n : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) throw() { free(p); }
+#if __cpp_sized_deallocation
+void operator delete(void *p, size_t) throw() { free(p); }
+#endif
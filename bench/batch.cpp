@@ -0,0 +1,101 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compares Range::find, FrozenRange::find and FrozenRange::findBatch
+ * on step functions with a growing number of separators. */
+
+#include "range.hpp"
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// keeps the compiler from dropping the lookups
+static volatile long sink;
+
+static int sum(const int a, const int b, void *extra){ return a + b; }
+
+static double now(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* a Range with 'cuts' separators, built as a chain of intersections */
+static Range<int,int> build(int cuts){
+  Range<int,int> r(0);
+  for (int i = 0; i < cuts; ++i) {
+    Range<int,int> step(0);
+    step.addRange(LESS_THAN, (rand() % 100000) - 50000, 1);
+    r = Range<int,int>::intersect(r, step, &sum, NULL);
+  }
+  return r;
+}
+
+int main(int argc, char **argv){
+  const size_t n = (argc > 1 ? atoi(argv[1]) : 1 << 20);
+  const int rounds = 10;
+  srand(42);
+
+  vector<int> keys(n);
+  for (size_t i = 0; i < n; ++i)
+    keys[i] = (rand() % 120000) - 60000;
+  vector<int> out(n);
+
+  cout << "kernel: " << BatchLookup::kernelName() << endl;
+  cout << "cuts\ttree Mkeys/s\tfrozen Mkeys/s\tbatch Mkeys/s\tmismatches" << endl;
+
+  int sizes[] = { 1, 4, 16, 32, 64, 256 };
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    Range<int,int> r = build(sizes[s]);
+    FrozenRange<int,int> frozen = r.freeze();
+    long checksum = 0;
+
+    double t0 = now();
+    for (int k = 0; k < rounds; ++k)
+      for (size_t i = 0; i < n; ++i)
+        checksum += r.find(keys[i]);
+    double t1 = now();
+    for (int k = 0; k < rounds; ++k)
+      for (size_t i = 0; i < n; ++i)
+        checksum += frozen.find(keys[i]);
+    double t2 = now();
+    for (int k = 0; k < rounds; ++k)
+      frozen.findBatch(&keys[0], n, &out[0]);
+    double t3 = now();
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < n; ++i)
+      if (out[i] != r.find(keys[i]))
+        ++mismatches;
+
+    const double total = (double)n * rounds / 1e6;
+    cout << frozen.segments() - 1 << "\t"
+         << total / (t1 - t0) << "\t"
+         << total / (t2 - t1) << "\t"
+         << total / (t3 - t2) << "\t"
+         << mismatches << endl;
+    sink = checksum;
+  }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Compares RangeBuilder with incremental Range::addRange() calls, on
+ * tables of (op, key, action) entries of growing size. */
+
+#include "builder.hpp"
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// keeps the compiler from dropping the lookups
+static volatile long sink;
+
+static double now(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv){
+  const size_t max_n = (argc > 1 ? atoi(argv[1]) : 1000000);
+  const size_t lookups = 1 << 20;
+  const RangeOperator_t ops[] = { LESS_THAN, LESS_EQUAL_THAN, GREAT_THAN, GREAT_EQUAL_THAN };
+  srand(42);
+
+  vector<int> keys(lookups);
+  for (size_t i = 0; i < lookups; ++i)
+    keys[i] = rand() % 2000000;
+
+  cout << "entries\tsegments\taddRange ms\tbuilder ms\taddRange Mkeys/s\tbuilder Mkeys/s\tmismatches" << endl;
+
+  for (size_t n = 1000; n <= max_n; n *= 10) {
+    // mostly points, plus a few half-lines near both ends
+    vector<RangeBuilder<int,int>::Entry> entries;
+    for (size_t i = 0; i < n; ++i) {
+      if (i % 100)
+        entries.push_back(RangeBuilder<int,int>::Entry(EQUAL, rand() % 2000000, rand() % 64));
+      else {
+        const RangeOperator_t op = ops[rand() % 4];
+        const int key = (op == LESS_THAN || op == LESS_EQUAL_THAN ? rand() % 1000 : 1999000 + rand() % 1000);
+        entries.push_back(RangeBuilder<int,int>::Entry(op, key, rand() % 64));
+      }
+    }
+
+    double t0 = now();
+    Range<int,int> incremental(0);
+    for (size_t i = 0; i < n; ++i)
+      incremental.addRange(entries[i].op, entries[i].key, entries[i].action);
+    double t1 = now();
+    RangeBuilder<int,int> builder(0);
+    builder.add(entries.begin(), entries.end());
+    Range<int,int> bulk = builder.build();
+    double t2 = now();
+
+    long checksum = 0;
+    for (size_t i = 0; i < lookups; ++i)
+      checksum += incremental.find(keys[i]);
+    double t3 = now();
+    for (size_t i = 0; i < lookups; ++i)
+      checksum += bulk.find(keys[i]);
+    double t4 = now();
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < lookups; ++i)
+      if (incremental.find(keys[i]) != bulk.find(keys[i]))
+        ++mismatches;
+
+    cout << n << "\t" << builder.freeze().segments() << "\t"
+         << (t1 - t0) * 1e3 << "\t" << (t2 - t1) * 1e3 << "\t"
+         << lookups / 1e6 / (t3 - t2) << "\t" << lookups / 1e6 / (t4 - t3) << "\t"
+         << mismatches << endl;
+    sink = checksum;
+  }
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compares intersections through a merger_func_t with the same
+ * intersections through a functor, which the merge can inline and which
+ * gets its actions by reference, on integer and string actions; both
+ * mergers are cheap, so that the cost of calling them shows. Times are
+ * the best of a few rounds. The first argument sets the largest number
+ * of separators (default 65536).
+ */
+
+#include "range.hpp"
+#include <iostream>
+#include <set>
+#include <string>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using namespace std;
+
+static double now(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int sum_pointer(const int a, const int b, void *extra){ return (a + b) & 63; }
+struct SumFunctor {
+  int operator()(const int &a, const int &b) const { return (a + b) & 63; }
+};
+
+// labels too long to be stored within a std::string, so that copies allocate
+static string min_pointer(const string a, const string b, void *extra){ return b < a ? b : a; }
+struct MinFunctor {
+  string operator()(const string &a, const string &b) const { return b < a ? b : a; }
+};
+
+template <class AType>
+struct Actions;
+
+template <>
+struct Actions<int>
+{
+  static const char* name() { return "int"; }
+  static int make(int i) { return i; }
+  typedef SumFunctor functor;
+  static int (*pointer())(const int, const int, void*) { return &sum_pointer; }
+};
+
+template <>
+struct Actions<string>
+{
+  static const char* name() { return "string"; }
+  static string make(int i) { return string(32, (char)('a' + i % 26)); }
+  typedef MinFunctor functor;
+  static string (*pointer())(const string, const string, void*) { return &min_pointer; }
+};
+
+/* about 'separators' cuts between intervals, plus as many punctual values */
+template <class AType>
+static Range<int,AType> random_range(size_t separators){
+  set<int> cuts;
+  while (cuts.size() < separators)
+    cuts.insert(rand() % (1 << 24));
+  Range<int,AType> r(Actions<AType>::make(rand() % 64));
+  // painting upwards in key order leaves one interval per cut
+  for (set<int>::iterator i = cuts.begin(); i != cuts.end(); ++i)
+    r.addRange(GREAT_EQUAL_THAN, *i, Actions<AType>::make(rand() % 64));
+  for (size_t i = 0; i < separators; ++i)
+    r.addRange(EQUAL, rand() % (1 << 24), Actions<AType>::make(rand() % 64));
+  return r;
+}
+
+template <class AType>
+static void run(size_t separators){
+  const size_t rounds = 9;
+  Range<int,AType> a = random_range<AType>(separators);
+  Range<int,AType> b = random_range<AType>(separators);
+
+  double best_pointer = 1e9, best_functor = 1e9;
+  size_t checksum_pointer = 0, checksum_functor = 0;
+  for (size_t i = 0; i < rounds; ++i) {
+    double t0 = now();
+    checksum_pointer += Range<int,AType>::intersect(a, b, Actions<AType>::pointer(), NULL).shape().nodes;
+    double t1 = now();
+    checksum_functor += Range<int,AType>::intersect(a, b, typename Actions<AType>::functor()).shape().nodes;
+    double t2 = now();
+    best_pointer = min(best_pointer, t1 - t0);
+    best_functor = min(best_functor, t2 - t1);
+  }
+
+  cout << Actions<AType>::name() << "\t" << separators << "\t"
+       << best_pointer * 1e3 << "\t" << best_functor * 1e3 << "\t"
+       << best_pointer / best_functor << "\t" << (checksum_pointer == checksum_functor) << endl;
+}
+
+int main(int argc, char **argv){
+  const size_t max_n = (argc > 1 ? atoi(argv[1]) : 65536);
+  srand(42);
+
+  cout << "actions\tseparators\tpointer ms\tfunctor ms\tspeedup\tsame" << endl;
+  for (size_t n = 256; n <= max_n; n *= 4) {
+    run<int>(n);
+    run<string>(n);
+  }
+
+  return 0;
+}
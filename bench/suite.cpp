@@ -0,0 +1,306 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Times the main operations of Range on randomized workloads: integer
+ * and string keys, a growing number of separators, with and without
+ * punctual values, and uniform or skewed streams of lookup keys.
+ * Each line of the output is one measure, as tab-separated values:
+ *   keys separators punctuals op stream ops ns/op merges/op allocs/op peak_rss_kB
+ * allocs/op counts the calls to operator new, so the chunks of the node
+ * arenas, which come from malloc(), are not included; peak_rss_kB is the
+ * peak of the whole process so far. The first argument scales the number
+ * of lookups (default 1048576).
+ * The suite fails if refining an IntersectionView one key at a time gets
+ * much slower as its inputs grow, as it does when each update walks the
+ * whole tree.
+ */
+
+#include "range.hpp"
+#include "view.hpp"
+#include <iostream>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// keeps the compiler from dropping the lookups
+static volatile long sink;
+
+// calls to operator new, counted by allocations.cpp
+extern size_t allocations;
+static size_t merges = 0;
+
+static int counting_sum(const int a, const int b, void *extra){ ++merges; return (a + b) % 64; }
+
+static double now(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static long peak_rss_kb(){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/* the keys of a workload come from integers in [0, domain) */
+static const int domain = 1 << 24;
+
+template <class KType>
+struct Keys;
+
+template <>
+struct Keys<int>
+{
+  static const char* name() { return "int"; }
+  static int make(int i) { return i; }
+};
+
+template <>
+struct Keys<string>
+{
+  static const char* name() { return "string"; }
+  // zero-padded, so that strings sort as the integers they come from
+  static string make(int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "k%08d", i);
+    return string(buf);
+  }
+};
+
+/* a Range with about 'separators' cuts between intervals, plus about
+ * 'punctuals' single keys, with actions in [0, 64) */
+template <class KType>
+static Range<KType,int> random_range(size_t separators, size_t punctuals){
+  set<int> cuts;
+  while (cuts.size() < separators)
+    cuts.insert(rand() % domain);
+  Range<KType,int> r(rand() % 64);
+  // painting upwards in key order leaves one interval per cut
+  for (set<int>::iterator i = cuts.begin(); i != cuts.end(); ++i)
+    r.addRange(GREAT_EQUAL_THAN, Keys<KType>::make(*i), rand() % 64);
+  for (size_t i = 0; i < punctuals; ++i)
+    r.addRange(EQUAL, Keys<KType>::make(rand() % domain), rand() % 64);
+  return r;
+}
+
+/* uniform keys, or nine out of ten going to a few hot ones */
+template <class KType>
+static vector<KType> key_stream(size_t n, bool skewed){
+  vector<KType> keys;
+  keys.reserve(n);
+  int hot[8];
+  for (int i = 0; i < 8; ++i)
+    hot[i] = rand() % domain;
+  for (size_t i = 0; i < n; ++i)
+    keys.push_back(Keys<KType>::make(skewed && rand() % 10 ? hot[rand() % 8] : rand() % domain));
+  return keys;
+}
+
+struct Measure {
+  size_t ops;
+  double t0;
+  size_t allocations0, merges0;
+
+  Measure(size_t ops) : ops(ops), t0(now()), allocations0(allocations), merges0(merges) {}
+
+  void report(const char *keys, size_t separators, size_t punctuals, const char *op, const char *stream){
+    const double elapsed = now() - t0;
+    cout << keys << "\t" << separators << "\t" << punctuals << "\t" << op << "\t" << stream << "\t"
+         << ops << "\t" << elapsed * 1e9 / ops << "\t"
+         << (double)(merges - merges0) / ops << "\t"
+         << (double)(allocations - allocations0) / ops << "\t"
+         << peak_rss_kb() << endl;
+  }
+};
+
+template <class KType>
+static void run(size_t separators, size_t punctuals, size_t lookups){
+  const char *keys = Keys<KType>::name();
+  Range<KType,int> r = random_range<KType>(separators, punctuals);
+
+  const char *streams[] = { "uniform", "skewed" };
+  for (int s = 0; s < 2; ++s) {
+    vector<KType> stream = key_stream<KType>(lookups, s == 1);
+    long checksum = 0;
+    Measure m(lookups);
+    for (size_t i = 0; i < lookups; ++i)
+      checksum += r.find(stream[i]);
+    m.report(keys, separators, punctuals, "find", streams[s]);
+    sink = checksum;
+  }
+
+  {
+    const size_t n = 16;
+    Measure m(n);
+    for (size_t i = 0; i < n; ++i)
+      sink = r.findAll().size();
+    m.report(keys, separators, punctuals, "findAll", "-");
+  }
+
+  {
+    const size_t n = 1024;
+    Measure m(n);
+    for (size_t i = 0; i < n; ++i) {
+      Range<KType,int> copy(r);
+      sink = copy.find(Keys<KType>::make(0));
+    }
+    m.report(keys, separators, punctuals, "copy", "-");
+  }
+
+  {
+    // points added to a copy that still shares its nodes with 'r'
+    const size_t n = 4096;
+    vector<KType> stream = key_stream<KType>(n, false);
+    Range<KType,int> copy(r);
+    Measure m(n);
+    for (size_t i = 0; i < n; ++i)
+      copy.addRange(EQUAL, stream[i], rand() % 64);
+    m.report(keys, separators, punctuals, "copyAddRange", "uniform");
+  }
+
+  {
+    // every copy gets modified, so that each one pays for its own nodes
+    const size_t n = 8;
+    vector<Range<KType,int> > copies(n, r);
+    map<int,int> mappings;
+    for (int a = 0; a < 64; ++a)
+      mappings[a] = (a + 1) % 64;
+    Measure m(n);
+    for (size_t i = 0; i < n; ++i)
+      copies[i].changeActions(mappings);
+    m.report(keys, separators, punctuals, "changeActions", "-");
+  }
+
+  {
+    const size_t n = 8;
+    vector<Range<KType,int> > chain;
+    for (size_t i = 0; i < n; ++i)
+      chain.push_back(random_range<KType>(separators, punctuals));
+    Range<KType,int> acc(r);
+    Measure m(n);
+    for (size_t i = 0; i < n; ++i)
+      acc = Range<KType,int>::intersect(acc, chain[i], &counting_sum, NULL);
+    m.report(keys, separators, punctuals, "intersect", "-");
+  }
+
+  {
+    // an intersection that is only queried: a few lookups, or its actions
+    Range<KType,int> other = random_range<KType>(separators, punctuals);
+    const size_t n = 1024;
+    vector<KType> stream = key_stream<KType>(n, false);
+    long checksum = 0;
+    Measure m(n);
+    LazyRange<KType,int> lazy = Range<KType,int>::lazyIntersect(r, other, &counting_sum, NULL);
+    for (size_t i = 0; i < n; ++i)
+      checksum += lazy.find(stream[i]);
+    m.report(keys, separators, punctuals, "lazyFind", "uniform");
+    sink = checksum;
+
+    const size_t rounds = 8;
+    Measure all(rounds);
+    for (size_t i = 0; i < rounds; ++i)
+      sink = Range<KType,int>::lazyIntersect(r, other, &counting_sum, NULL).findAll().size();
+    all.report(keys, separators, punctuals, "lazyFindAll", "-");
+  }
+
+  {
+    // one more addRange() at a time to an input of an intersection, with
+    // the result patched by an IntersectionView or intersected again;
+    // a cut paints half of the key space, crossing about half of the
+    // segments of the other input
+    Range<KType,int> other = random_range<KType>(separators, punctuals);
+    const char *refinements[] = { "point", "cut" };
+    for (int k = 0; k < 2; ++k) {
+      const size_t n = 16;
+      vector<KType> stream = key_stream<KType>(n, false);
+      const RangeOperator_t op = (k == 0 ? EQUAL : GREAT_THAN);
+
+      IntersectionView<KType,int> view(r, other, &counting_sum, NULL);
+      Measure m(n);
+      for (size_t i = 0; i < n; ++i)
+        view.addRange(0, op, stream[i], rand() % 64);
+      m.report(keys, separators, punctuals, "viewRefine", refinements[k]);
+
+      Range<KType,int> input(r);
+      Measure again(n);
+      for (size_t i = 0; i < n; ++i) {
+        input.addRange(op, stream[i], rand() % 64);
+        sink = Range<KType,int>::intersect(input, other, &counting_sum, NULL).find(stream[i]);
+      }
+      again.report(keys, separators, punctuals, "reintersect", refinements[k]);
+    }
+  }
+}
+
+/* times point refinements of views over small and large inputs; their
+ * cost must stay about flat, while a walk of the trees is 64 times more
+ * expensive on the large ones */
+static bool view_refinement_is_flat(){
+  const size_t sizes[] = { 1024, 65536 };
+  const size_t n = 4096;
+  double best[2];
+  for (int s = 0; s < 2; ++s) {
+    Range<int,int> a = random_range<int>(sizes[s], 0);
+    Range<int,int> b = random_range<int>(sizes[s], 0);
+    IntersectionView<int,int> view(a, b, &counting_sum, NULL);
+    best[s] = 0;
+    // the best of a few rounds, to leave out the noise of the machine
+    for (int round = 0; round < 3; ++round) {
+      vector<int> stream = key_stream<int>(n, false);
+      Measure m(n);
+      for (size_t i = 0; i < n; ++i)
+        view.addRange(round % 2, EQUAL, stream[i], rand() % 64);
+      const double elapsed = now() - m.t0;
+      if (round == 0 || elapsed < best[s])
+        best[s] = elapsed;
+      if (round == 2)
+        m.report("int", sizes[s], 0, "viewScaling", "point");
+    }
+  }
+  return best[1] < 8 * best[0];
+}
+
+int main(int argc, char **argv){
+  const size_t lookups = (argc > 1 ? atoi(argv[1]) : 1 << 20);
+  srand(42);
+
+  cout << "keys\tseparators\tpunctuals\top\tstream\tops\tns/op\tmerges/op\tallocs/op\tpeak_rss_kB" << endl;
+
+  size_t separators[] = { 64, 4096, 65536 };
+  size_t punctuals[] = { 0, 4096 };
+  for (size_t s = 0; s < sizeof(separators) / sizeof(separators[0]); ++s)
+    for (size_t p = 0; p < sizeof(punctuals) / sizeof(punctuals[0]); ++p) {
+      run<int>(separators[s], punctuals[p], lookups);
+      run<string>(separators[s], punctuals[p], lookups / 4);
+    }
+
+  if (!view_refinement_is_flat()) {
+    cerr << "point refinements of an IntersectionView grow with its inputs" << endl;
+    return 1;
+  }
+  return 0;
+}
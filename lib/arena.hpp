@@ -0,0 +1,147 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_HPP_INCLUDED
+#define ARENA_HPP_INCLUDED
+
+#include <vector>
+#include <stdlib.h>
+
+/* A pool of objects of type T. Memory is obtained in chunks of growing
+ * size and handed out by bumping a pointer; released objects are
+ * destroyed at once and their slots are kept in a free list for reuse.
+ * When the pool goes away, the objects still alive are destroyed and
+ * the chunks are freed, without any per-object deallocation.
+ */
+template <class T>
+class Pool
+{
+public:
+  Pool() : free_list(NULL), live(0) {}
+  ~Pool() {
+    for (size_t c = 0; c < chunks.size(); ++c) {
+      for (size_t i = 0; i < chunks[c].used; ++i)
+        if (chunks[c].slots[i].live)
+          object(&chunks[c].slots[i])->~T();
+      free(chunks[c].slots);
+    }
+  }
+
+  // returns raw storage for a T; it must be constructed with placement new
+  void* allocate() {
+    Slot *slot = free_list;
+    if (slot) {
+      free_list = slot->next_free;
+    } else {
+      if (chunks.empty() || chunks.back().used == chunks.back().capacity) {
+        Chunk c;
+        c.capacity = chunkSize(chunks.size());
+        c.used = 0;
+        c.slots = (Slot*) malloc(c.capacity * sizeof(Slot));
+        if (!c.slots) abort(); // out of memory
+        chunks.push_back(c);
+      }
+      slot = &chunks.back().slots[chunks.back().used++];
+    }
+    slot->live = true;
+    ++live;
+    return slot->u.bytes;
+  }
+
+  // makes room for 'n' more objects in a single chunk, unless the
+  // current one has enough of it already
+  void reserve(size_t n) {
+    if (n == 0)
+      return;
+    if (!chunks.empty() && chunks.back().capacity - chunks.back().used >= n)
+      return;
+    Chunk c;
+    c.capacity = n;
+    c.used = 0;
+    c.slots = (Slot*) malloc(c.capacity * sizeof(Slot));
+    if (!c.slots) abort(); // out of memory
+    chunks.push_back(c);
+  }
+
+  void release(T *obj) {
+    obj->~T();
+    // the object lies at the very beginning of its slot
+    Slot *slot = reinterpret_cast<Slot*>(obj);
+    slot->live = false;
+    slot->next_free = free_list;
+    free_list = slot;
+    --live;
+  }
+
+  // takes over all the objects and the memory of 'other', which is left empty
+  void adopt(Pool &other) {
+    if (other.free_list) {
+      Slot *tail = other.free_list;
+      while (tail->next_free)
+        tail = tail->next_free;
+      tail->next_free = free_list;
+      free_list = other.free_list;
+    }
+    // keep our partially used chunk last, so that bumping goes on there
+    chunks.insert(chunks.begin(), other.chunks.begin(), other.chunks.end());
+    live += other.live;
+
+    other.chunks.clear();
+    other.free_list = NULL;
+    other.live = 0;
+  }
+
+  size_t liveObjects() const { return live; }
+
+private:
+  struct Slot {
+    union {
+      char bytes[sizeof(T)];
+      // force an alignment that suits any T
+      long double align_ld;
+      long long align_ll;
+      void *align_ptr;
+    } u;
+    Slot *next_free;
+    bool live;
+  };
+
+  struct Chunk {
+    Slot *slots;
+    size_t used; // slots handed out at least once
+    size_t capacity;
+  };
+
+  std::vector<Chunk> chunks;
+  Slot *free_list;
+  size_t live;
+
+  // chunks double in size, from 16 up to 1024 slots
+  static size_t chunkSize(size_t index) {
+    return (index < 6 ? (size_t)16 << index : 1024);
+  }
+  static T* object(Slot *slot) { return reinterpret_cast<T*>(slot->u.bytes); }
+
+  // pools are never copied
+  Pool(const Pool&);
+  Pool& operator=(const Pool&);
+};
+
+#endif /* ARENA_HPP_INCLUDED */
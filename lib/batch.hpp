@@ -0,0 +1,175 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+ 
+ This file is part of librange.
+ 
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ 
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATCH_HPP_INCLUDED
+#define BATCH_HPP_INCLUDED
+
+#include <limits>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIBRANGE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Batch lookups work on integral keys mapped to signed 32-bit lanes,
+ * so that the same vector compares serve every key type that fits.
+ * The mapping must preserve the ordering of the keys.
+ */
+template <class KType,
+          bool fits = (std::numeric_limits<KType>::is_integer &&
+                       sizeof(KType) <= sizeof(int32_t))>
+struct KeyLanes
+{
+  static const bool enabled = false;
+  static int32_t toLane(const KType &key) { return 0; }
+};
+
+template <class KType>
+struct KeyLanes<KType, true>
+{
+  static const bool enabled = true;
+  static int32_t toLane(const KType &key) {
+    // unsigned 32-bit keys are shifted, so that signed compares keep working
+    if (!std::numeric_limits<KType>::is_signed && sizeof(KType) == sizeof(int32_t))
+      return (int32_t)((uint32_t)key ^ 0x80000000u);
+    return (int32_t)key;
+  }
+};
+
+/* For each key x[i], BatchLookup stores in out[i] the number of
+ * thresholds that are strictly smaller than x[i]; thresholds must be
+ * sorted. The best kernel supported by the running CPU is selected the
+ * first time classify() is invoked.
+ */
+class BatchLookup
+{
+  typedef void(*kernel_func_t)(const int32_t*, size_t, const int32_t*, size_t, uint32_t*);
+
+public:
+  // up to this many thresholds, a linear scan beats a binary search
+  static const size_t LINEAR_MAX = 32;
+
+  static void classify(const int32_t *thr, size_t m, const int32_t *x, size_t n, uint32_t *out) {
+    static kernel_func_t kernel = select();
+    (*kernel)(thr, m, x, n, out);
+  }
+
+  static const char* kernelName() {
+    kernel_func_t k = select();
+#ifdef LIBRANGE_X86_SIMD
+    if (k == &classify_avx2) return "avx2";
+    if (k == &classify_sse2) return "sse2";
+#endif
+    return (k == &classify_scalar ? "scalar" : "unknown");
+  }
+
+  static void classify_scalar(const int32_t *thr, size_t m, const int32_t *x, size_t n, uint32_t *out) {
+    for (size_t i = 0; i < n; ++i)
+      out[i] = lowerBound(thr, m, x[i]);
+  }
+
+private:
+  static kernel_func_t select() {
+#ifdef LIBRANGE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return &classify_avx2;
+    if (__builtin_cpu_supports("sse2"))
+      return &classify_sse2;
+#endif
+    return &classify_scalar;
+  }
+
+  // branch-free binary search
+  static inline uint32_t lowerBound(const int32_t *thr, size_t m, int32_t x) {
+    if (m == 0)
+      return 0;
+    const int32_t *base = thr;
+    for (size_t len = m; len > 1; ) {
+      size_t half = len / 2;
+      base = (base[half] < x ? base + half : base);
+      len -= half;
+    }
+    return (uint32_t)((base - thr) + (*base < x));
+  }
+
+#ifdef LIBRANGE_X86_SIMD
+  __attribute__ ((target("sse2")))
+  static void classify_sse2(const int32_t *thr, size_t m, const int32_t *x, size_t n, uint32_t *out) {
+    if (m > LINEAR_MAX) {
+      // no gathers before AVX2: a vector binary search would not pay off
+      classify_scalar(thr, m, x, n, out);
+      return;
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      const __m128i keys = _mm_loadu_si128((const __m128i*)(x + i));
+      __m128i count = _mm_setzero_si128();
+      for (size_t j = 0; j < m; ++j)
+        // each true compare is -1, so subtracting counts it
+        count = _mm_sub_epi32(count, _mm_cmpgt_epi32(keys, _mm_set1_epi32(thr[j])));
+      _mm_storeu_si128((__m128i*)(out + i), count);
+    }
+    classify_scalar(thr, m, x + i, n - i, out + i);
+  }
+
+  __attribute__ ((target("avx2")))
+  static void classify_avx2(const int32_t *thr, size_t m, const int32_t *x, size_t n, uint32_t *out) {
+    size_t i = 0;
+    if (m == 0) {
+      for (; i < n; ++i)
+        out[i] = 0;
+      return;
+    }
+
+    if (m <= LINEAR_MAX) {
+      for (; i + 8 <= n; i += 8) {
+        const __m256i keys = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i count = _mm256_setzero_si256();
+        for (size_t j = 0; j < m; ++j)
+          count = _mm256_sub_epi32(count, _mm256_cmpgt_epi32(keys, _mm256_set1_epi32(thr[j])));
+        _mm256_storeu_si256((__m256i*)(out + i), count);
+      }
+    } else {
+      // the branch-free binary search, run on 8 keys at once
+      for (; i + 8 <= n; i += 8) {
+        const __m256i keys = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i base = _mm256_setzero_si256();
+        for (size_t len = m; len > 1; ) {
+          size_t half = len / 2;
+          const __m256i vhalf = _mm256_set1_epi32((int)half);
+          const __m256i probe = _mm256_i32gather_epi32((const int*)thr, _mm256_add_epi32(base, vhalf), 4);
+          base = _mm256_add_epi32(base, _mm256_and_si256(_mm256_cmpgt_epi32(keys, probe), vhalf));
+          len -= half;
+        }
+        const __m256i last = _mm256_i32gather_epi32((const int*)thr, base, 4);
+        base = _mm256_sub_epi32(base, _mm256_cmpgt_epi32(keys, last));
+        _mm256_storeu_si256((__m256i*)(out + i), base);
+      }
+    }
+    classify_scalar(thr, m, x + i, n - i, out + i);
+  }
+#endif /* LIBRANGE_X86_SIMD */
+};
+
+#endif /* BATCH_HPP_INCLUDED */
@@ -0,0 +1,183 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BUILDER_HPP_INCLUDED
+#define BUILDER_HPP_INCLUDED
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "range.hpp"
+
+/* Builds a Range out of many (op, key, action) entries at once. The
+ * entries are resolved as if they were added with Range::addRange() in
+ * the same order, i.e. later entries win where they overlap, but the
+ * tree is built bottom-up in one go: it is perfectly balanced, and its
+ * nodes come from two allocations, one for the ActionNode(s) and one for
+ * the RangeOpNode(s). Sorting the entries costs O(n log n); everything
+ * else is linear.
+ */
+template <class KType, class AType>
+class RangeBuilder
+{
+public:
+  struct Entry {
+    RangeOperator_t op;
+    KType key;
+    AType action;
+
+    Entry(RangeOperator_t op, const KType &key, const AType &action)
+      : op(op), key(key), action(action) {}
+  };
+
+  RangeBuilder(const AType &dfl_action) : default_action(dfl_action) {}
+
+  void add(RangeOperator_t op, const KType &key, const AType &action) {
+    if (op == INVALID)
+      abort();
+    entries.push_back(Entry(op, key, action));
+  }
+
+  // 'Iterator' must point to Entry(s), or to anything with the same members
+  template <class Iterator>
+  void add(Iterator first, Iterator last) {
+    for (; first != last; ++first)
+      add(first->op, first->key, first->action);
+  }
+
+  size_t size() const { return entries.size(); }
+  void clear() { entries.clear(); }
+
+  Range<KType,AType> build() const {
+    Linearization<KType,AType> lin;
+    resolve(lin);
+    Range<KType,AType> result(lin.actions[0]);
+    // a balanced tree over n segments has n ActionNode(s) and n-1 RangeOpNode(s)
+    result.arena->reserve(lin.actions.size(), lin.cuts.size());
+    result.rebuild(lin);
+    return result;
+  }
+
+  FrozenRange<KType,AType> freeze() const {
+    Linearization<KType,AType> lin;
+    resolve(lin);
+    return FrozenRange<KType,AType>(lin);
+  }
+
+private:
+  AType default_action;
+  std::vector<Entry> entries;
+
+  // a cut, and the position of the entry that brought it in
+  typedef std::pair<Cut<KType>, size_t> Mark;
+
+  static bool markBefore(const Mark &a, const Mark &b) { return a.first < b.first; }
+
+  // an output iterator storing only the cut of each Mark
+  struct MarkCutIterator {
+    typename std::vector<Cut<KType> >::iterator i;
+    MarkCutIterator(typename std::vector<Cut<KType> >::iterator i) : i(i) {}
+    MarkCutIterator& operator*() { return *this; }
+    MarkCutIterator& operator=(const Mark &m) { *i = m.first; return *this; }
+    MarkCutIterator& operator++() { ++i; return *this; }
+    MarkCutIterator operator++(int) { MarkCutIterator tmp(*this); ++i; return tmp; }
+  };
+
+  /* Flattens the entries into 'lin'. Each segment between two
+   * consecutive cuts takes the action of the latest entry covering it:
+   * the latest '<' above it, the latest '>' below it, or the latest
+   * '=' on it, if it is made of a single key.
+   */
+  void resolve(Linearization<KType,AType> &lin) const {
+    std::vector<Mark> below, above, points;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const Entry &e = entries[i];
+      switch (e.op) {
+      case LESS_THAN:
+      case LESS_EQUAL_THAN:
+        below.push_back(Mark(Cut<KType>(e.key, e.op == LESS_EQUAL_THAN), i));
+        break;
+      case GREAT_THAN:
+      case GREAT_EQUAL_THAN:
+        above.push_back(Mark(Cut<KType>(e.key, e.op == GREAT_THAN), i));
+        break;
+      case EQUAL:
+        // a point is the segment between (key, false) and (key, true)
+        points.push_back(Mark(Cut<KType>(e.key, false), i));
+        break;
+      default:
+        abort();
+      }
+    }
+    std::sort(below.begin(), below.end(), markBefore);
+    std::sort(above.begin(), above.end(), markBefore);
+    std::sort(points.begin(), points.end(), markBefore);
+
+    // all the distinct cuts, in order, merging the sorted sequences
+    std::vector<Cut<KType> > point_cuts;
+    point_cuts.reserve(2 * points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+      point_cuts.push_back(points[i].first);
+      point_cuts.push_back(Cut<KType>(points[i].first.key, true));
+    }
+    std::vector<Cut<KType> > half_cuts(below.size() + above.size());
+    std::merge(below.begin(), below.end(), above.begin(), above.end(),
+               MarkCutIterator(half_cuts.begin()), markBefore);
+    std::vector<Cut<KType> > cuts(half_cuts.size() + point_cuts.size());
+    std::merge(half_cuts.begin(), half_cuts.end(), point_cuts.begin(), point_cuts.end(), cuts.begin());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+
+    // the latest entry covering each segment, plus one (0 for none);
+    // segment j lies between cuts[j-1] and cuts[j]
+    const size_t n = cuts.size() + 1;
+    std::vector<size_t> from_below(n, 0), from_above(n, 0), winner(n, 0);
+    // a '<' covers the segments up to its cut...
+    for (size_t i = 0, j = 0; i < below.size(); ++i) {
+      while (cuts[j] < below[i].first)
+        ++j;
+      from_below[j] = std::max(from_below[j], below[i].second + 1);
+    }
+    for (size_t j = n - 1; j-- > 0; )
+      from_below[j] = std::max(from_below[j], from_below[j + 1]);
+    // ... and a '>' the ones after its cut
+    for (size_t i = 0, j = 0; i < above.size(); ++i) {
+      while (cuts[j] < above[i].first)
+        ++j;
+      from_above[j + 1] = std::max(from_above[j + 1], above[i].second + 1);
+    }
+    for (size_t j = 1; j < n; ++j)
+      from_above[j] = std::max(from_above[j], from_above[j - 1]);
+    for (size_t j = 0; j < n; ++j)
+      winner[j] = std::max(from_below[j], from_above[j]);
+    for (size_t i = 0, j = 0; i < points.size(); ++i) {
+      while (cuts[j] < points[i].first)
+        ++j;
+      winner[j + 1] = std::max(winner[j + 1], points[i].second + 1);
+    }
+
+    for (size_t j = 0; j < n; ++j)
+      lin.append(j < cuts.size() ? &cuts[j] : NULL,
+                 winner[j] ? entries[winner[j] - 1].action : default_action);
+    lin.coalesce();
+  }
+};
+
+#endif /* BUILDER_HPP_INCLUDED */
@@ -0,0 +1,107 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CACHE_HPP_INCLUDED
+#define CACHE_HPP_INCLUDED
+
+#include <functional>
+#include <map>
+#include <utility>
+
+/* Remembers the result of the merger for each pair of actions it has
+ * seen, so that every distinct (a, b) pair is merged only once. A cache
+ * can be passed to a single intersection or kept across a whole session;
+ * in the latter case the merger and its extra_info must not change,
+ * since they are not part of the key.
+ * Actions are compared with 'Compare', std::less by default. A cache is
+ * not thread safe.
+ */
+template <class AType, class Compare = std::less<AType> >
+class MergeCache
+{
+public:
+  typedef AType(*merger_func_t)(const AType, const AType, void*);
+
+  MergeCache(const Compare &cmp = Compare()) : results(PairCompare(cmp)), hit_count(0), miss_count(0) {}
+
+  AType merge(const AType &a, const AType &b, merger_func_t merger, void *extra_info) {
+    CallMerger call = { merger, extra_info };
+    return merge(a, b, call);
+  }
+
+  // the same, with any callable taking two const AType&
+  template <class Merger>
+  AType merge(const AType &a, const AType &b, Merger &merger) {
+    const std::pair<AType,AType> key(a, b);
+    typename ResultMap::iterator i = results.lower_bound(key);
+    if (i != results.end() && !results.key_comp()(key, i->first)) {
+      ++hit_count;
+      return i->second;
+    }
+    ++miss_count;
+    return results.insert(i, std::make_pair(key, merger(a, b)))->second;
+  }
+
+  size_t hits() const { return hit_count; }
+  size_t misses() const { return miss_count; }
+  size_t size() const { return results.size(); }
+
+  // forgets all the results, and zeroes the counters
+  void clear() {
+    results.clear();
+    hit_count = miss_count = 0;
+  }
+
+private:
+  struct CallMerger {
+    merger_func_t merger;
+    void *extra_info;
+    AType operator()(const AType &a, const AType &b) const { return (*merger)(a, b, extra_info); }
+  };
+
+  // orders pairs of actions lexicographically, through 'Compare'
+  struct PairCompare {
+    Compare cmp;
+    PairCompare(const Compare &cmp) : cmp(cmp) {}
+    bool operator()(const std::pair<AType,AType> &x, const std::pair<AType,AType> &y) const {
+      if (cmp(x.first, y.first)) return true;
+      if (cmp(y.first, x.first)) return false;
+      return cmp(x.second, y.second);
+    }
+  };
+  typedef std::map<std::pair<AType,AType>, AType, PairCompare> ResultMap;
+
+  ResultMap results;
+  size_t hit_count, miss_count;
+};
+
+/* A merger answered by 'cache' whenever it can, 'merger' otherwise */
+template <class AType, class Compare, class Merger>
+struct CachedMerger
+{
+  MergeCache<AType,Compare> *cache;
+  Merger *merger;
+
+  CachedMerger(MergeCache<AType,Compare> *cache, Merger *merger) : cache(cache), merger(merger) {}
+  inline AType operator()(const AType &a, const AType &b) const { return cache->merge(a, b, *merger); }
+};
+
+#endif /* CACHE_HPP_INCLUDED */
@@ -0,0 +1,434 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CODEGEN_HPP_INCLUDED
+#define CODEGEN_HPP_INCLUDED
+
+#include <limits>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "internals.hpp"
+
+/* The relative costs used to lower a group of neighbouring segments:
+ * either a compare tree, a jump table or a few bit tests */
+struct CodegenCosts
+{
+  unsigned compare;     // a single "key <= threshold" branch
+  unsigned table;       // an indexed load from a jump table
+  unsigned bit_test;    // a shift and a test against a 64-bit mask
+  size_t max_table;     // largest number of keys a table can cover
+  size_t max_sparsity;  // largest number of keys per segment in a table
+
+  CodegenCosts()
+    : compare(1), table(2), bit_test(1), max_table(1024), max_sparsity(8) {}
+};
+
+/* A Range lowered into a decision program for integral keys. The
+ * segments are grouped into units: dense clusters of segments become a
+ * jump table, or a few bit tests when they hold at most a handful of
+ * actions in at most 64 keys; any other segment is a unit of its own.
+ * A balanced compare tree then picks the unit of a key, so a lookup
+ * takes about log2(units) branches, plus one table or bit-test unit.
+ * The same program can be run in memory with find(), or emitted as the
+ * C++ source of a function returning action ids with emit().
+ */
+template <class KType, class AType>
+class DecisionProgram
+{
+public:
+  DecisionProgram(const Linearization<KType,AType> &lin, const CodegenCosts &costs = CodegenCosts());
+  AType find(KType key) const { return actions[findId(key)]; }
+  uint32_t findId(KType key) const;
+  const AType& action(uint32_t id) const { return actions[id]; }
+  size_t actionCount() const { return actions.size(); }
+  void emit(std::ostream &out, const std::string &function, const std::string &key_type) const;
+
+  // what the program is made of
+  struct Stats {
+    size_t segments;
+    size_t compares;     // compare steps
+    size_t tables;       // jump tables, and the entries of all of them
+    size_t table_entries;
+    size_t bit_groups;   // bit-test units, and the masks of all of them
+    size_t masks;
+    size_t max_branches; // most compare and bit-test branches on any path
+  };
+  Stats stats() const;
+
+private:
+  enum StepKind { LEAF, COMPARE, TABLE, BITS };
+  // LEAF: returns action 'first'
+  // COMPARE: goes to step 'first' if key <= pivot, to step 'second' otherwise
+  // TABLE: returns table[first + (key - pivot)], out of 'second' entries
+  // BITS: returns the action of the first of the 'second' masks at
+  //       'first' that has bit (key - pivot) set; the last one has all
+  struct Step {
+    StepKind kind;
+    KType pivot;
+    uint32_t first;
+    uint32_t second;
+  };
+  struct Mask {
+    uint64_t bits;
+    uint32_t id;
+  };
+
+  std::vector<AType> actions;
+  std::vector<Step> steps;
+  std::vector<uint32_t> table;
+  std::vector<Mask> masks;
+  size_t n_segments;
+
+  // segment i holds the keys in (last[i-1], last[i]]; the last one is open
+  std::vector<KType> last;
+  std::vector<uint32_t> ids;
+  // units are the segments [unit_first[u], unit_first[u+1])
+  std::vector<size_t> unit_first;
+  std::vector<StepKind> unit_kind;
+
+  void segment(const Linearization<KType,AType> &lin);
+  void group(const CodegenCosts &costs);
+  StepKind lower(size_t first, size_t end, const CodegenCosts &costs) const;
+  uint32_t build(size_t u_first, size_t u_end);
+  uint32_t buildUnit(size_t u);
+  size_t branches(uint32_t step) const;
+  void emitStep(std::ostream &out, uint32_t step, const std::string &indent) const;
+
+  static uint64_t offset(const KType &key, const KType &base) {
+    return (uint64_t)key - (uint64_t)base;
+  }
+  static void emitKey(std::ostream &out, const KType &key);
+};
+
+
+/* == template implementation follows == */
+template <class KType, class AType>
+DecisionProgram<KType,AType>::DecisionProgram(const Linearization<KType,AType> &lin, const CodegenCosts &costs)
+{
+  if (!std::numeric_limits<KType>::is_integer)
+    abort(); // tables and bit tests need integral keys
+
+  segment(lin);
+  group(costs);
+  build(0, unit_kind.size());
+  n_segments = ids.size();
+
+  // only the program itself is needed from now on
+  std::vector<KType>().swap(last);
+  std::vector<uint32_t>().swap(ids);
+  std::vector<size_t>().swap(unit_first);
+  std::vector<StepKind>().swap(unit_kind);
+}
+
+/* turns the cuts of 'lin' into the last key of each segment, dropping
+ * the segments that hold no integer at all, and the actions into ids */
+template <class KType, class AType>
+void DecisionProgram<KType,AType>::segment(const Linearization<KType,AType> &lin)
+{
+  if (lin.actions.size() != lin.cuts.size() + 1)
+    abort(); // only a whole tree can be compiled
+
+  std::map<AType,uint32_t> known;
+  for (size_t i = 0; i < lin.actions.size(); ++i) {
+    const bool open = (i == lin.cuts.size());
+    KType upto = KType();
+    if (!open) {
+      const Cut<KType> &cut = lin.cuts[i];
+      if (!cut.incl && cut.key == std::numeric_limits<KType>::min())
+        continue; // below the smallest key
+      // a key lies below (k, true) if it is <= k, below (k, false) if it is <= k-1
+      upto = (cut.incl ? cut.key : cut.key - 1);
+      if (!last.empty() && !(last.back() < upto))
+        continue; // between two consecutive integers
+    }
+
+    typename std::map<AType,uint32_t>::iterator it = known.find(lin.actions[i]);
+    if (it == known.end()) {
+      it = known.insert(std::make_pair(lin.actions[i], (uint32_t)actions.size())).first;
+      actions.push_back(lin.actions[i]);
+    }
+    if (!ids.empty() && ids.back() == it->second) {
+      // dropped segments can leave two of the same action side by side
+      if (!open)
+        last.back() = upto;
+      else
+        last.pop_back();
+      continue;
+    }
+    ids.push_back(it->second);
+    if (!open)
+      last.push_back(upto);
+  }
+}
+
+/* splits the segments into units, left to right: each one is the widest
+ * run of segments that is dense enough for a table, if lowering it that
+ * way beats a compare tree, or a single segment otherwise */
+template <class KType, class AType>
+void DecisionProgram<KType,AType>::group(const CodegenCosts &costs)
+{
+  const size_t n = ids.size();
+  size_t i = 0;
+  while (i < n) {
+    size_t best_end = i + 1;
+    // the first and the last segment are unbounded, so they never fit a table
+    if (i > 0) {
+      for (size_t end = i + 2; end < n; ++end) {
+        const uint64_t span = offset(last[end - 1], last[i - 1]);
+        if (span > costs.max_table)
+          break;
+        if (span <= costs.max_sparsity * (end - i))
+          best_end = end;
+      }
+    }
+
+    StepKind kind = LEAF;
+    if (best_end - i > 1)
+      kind = lower(i, best_end, costs);
+    if (kind == COMPARE)
+      best_end = i + 1, kind = LEAF;
+    unit_first.push_back(i);
+    unit_kind.push_back(kind);
+    i = best_end;
+  }
+  unit_first.push_back(n);
+}
+
+/* the cheapest way to pick a segment out of [first, end) */
+template <class KType, class AType>
+typename DecisionProgram<KType,AType>::StepKind DecisionProgram<KType,AType>::lower(size_t first, size_t end, const CodegenCosts &costs) const
+{
+  size_t compares = 0;
+  while (((size_t)1 << compares) < end - first)
+    ++compares;
+  StepKind kind = COMPARE;
+  size_t cost = compares * costs.compare;
+
+  if (costs.table < cost) {
+    kind = TABLE;
+    cost = costs.table;
+  }
+
+  if (offset(last[end - 1], last[first - 1]) <= 64) {
+    std::vector<bool> seen(actions.size(), false);
+    size_t distinct = 0;
+    for (size_t i = first; i < end; ++i)
+      if (!seen[ids[i]]) {
+        seen[ids[i]] = true;
+        ++distinct;
+      }
+    // the last action needs no test of its own; on a tie, bit tests
+    // win over a table, since they need no memory
+    if ((distinct - 1) * costs.bit_test <= cost)
+      kind = BITS;
+  }
+  return kind;
+}
+
+/* builds the compare tree over the units [u_first, u_end), returning its root */
+template <class KType, class AType>
+uint32_t DecisionProgram<KType,AType>::build(size_t u_first, size_t u_end)
+{
+  if (u_end - u_first == 1)
+    return buildUnit(u_first);
+
+  const size_t u_mid = u_first + (u_end - u_first) / 2;
+  const uint32_t at = (uint32_t)steps.size();
+  Step s;
+  s.kind = COMPARE;
+  s.pivot = last[unit_first[u_mid] - 1];
+  steps.push_back(s);
+  const uint32_t below = build(u_first, u_mid);
+  const uint32_t above = build(u_mid, u_end);
+  steps[at].first = below;
+  steps[at].second = above;
+  return at;
+}
+
+template <class KType, class AType>
+uint32_t DecisionProgram<KType,AType>::buildUnit(size_t u)
+{
+  const size_t first = unit_first[u], end = unit_first[u + 1];
+  Step s;
+  s.kind = unit_kind[u];
+  s.pivot = KType();
+  s.second = 0;
+
+  if (s.kind == LEAF) {
+    s.first = ids[first];
+  } else if (s.kind == TABLE) {
+    s.pivot = last[first - 1] + 1;
+    s.first = (uint32_t)table.size();
+    KType key = s.pivot;
+    for (size_t i = first; i < end; ++i)
+      for (;; ++key) {
+        table.push_back(ids[i]);
+        if (key == last[i]) {
+          ++key;
+          break;
+        }
+      }
+    s.second = (uint32_t)(table.size() - s.first);
+  } else {
+    s.pivot = last[first - 1] + 1;
+    s.first = (uint32_t)masks.size();
+    // one mask per action, in order of first appearance
+    std::map<uint32_t,size_t> mask_of;
+    for (size_t i = first; i < end; ++i) {
+      if (mask_of.find(ids[i]) == mask_of.end()) {
+        mask_of[ids[i]] = masks.size();
+        Mask m;
+        m.bits = 0;
+        m.id = ids[i];
+        masks.push_back(m);
+      }
+      Mask &m = masks[mask_of[ids[i]]];
+      for (uint64_t bit = offset(last[i - 1] + 1, s.pivot); bit <= offset(last[i], s.pivot); ++bit)
+        m.bits |= (uint64_t)1 << bit;
+    }
+    masks.back().bits = ~(uint64_t)0;
+    s.second = (uint32_t)(masks.size() - s.first);
+  }
+
+  steps.push_back(s);
+  return (uint32_t)(steps.size() - 1);
+}
+
+/* returns the id of the action associated with the provided key */
+template <class KType, class AType>
+uint32_t DecisionProgram<KType,AType>::findId(KType key) const
+{
+  const Step *s = &steps[0];
+  while (s->kind == COMPARE)
+    s = &steps[key <= s->pivot ? s->first : s->second];
+
+  switch (s->kind) {
+  case LEAF:
+    return s->first;
+  case TABLE:
+    return table[s->first + offset(key, s->pivot)];
+  default: {
+    const uint64_t bit = offset(key, s->pivot);
+    const Mask *m = &masks[s->first];
+    while (!((m->bits >> bit) & 1))
+      ++m;
+    return m->id;
+  }
+  }
+}
+
+template <class KType, class AType>
+typename DecisionProgram<KType,AType>::Stats DecisionProgram<KType,AType>::stats() const
+{
+  Stats to_ret;
+  to_ret.segments = n_segments;
+  to_ret.compares = to_ret.tables = to_ret.bit_groups = 0;
+  for (size_t i = 0; i < steps.size(); ++i) {
+    if (steps[i].kind == COMPARE)
+      ++to_ret.compares;
+    else if (steps[i].kind == TABLE)
+      ++to_ret.tables;
+    else if (steps[i].kind == BITS)
+      ++to_ret.bit_groups;
+  }
+  to_ret.table_entries = table.size();
+  to_ret.masks = masks.size();
+  to_ret.max_branches = branches(0);
+  return to_ret;
+}
+
+template <class KType, class AType>
+size_t DecisionProgram<KType,AType>::branches(uint32_t step) const
+{
+  const Step &s = steps[step];
+  if (s.kind == COMPARE) {
+    const size_t below = branches(s.first), above = branches(s.second);
+    return 1 + (below > above ? below : above);
+  }
+  // the last mask of a bit-test unit is never tested
+  return (s.kind == BITS ? s.second - 1 : 0);
+}
+
+/* writes the C++ source of "uint32_t function(key_type key)", returning
+ * the same action ids as findId() */
+template <class KType, class AType>
+void DecisionProgram<KType,AType>::emit(std::ostream &out, const std::string &function, const std::string &key_type) const
+{
+  out << "uint32_t " << function << "(" << key_type << " key)" << std::endl
+      << "{" << std::endl;
+  emitStep(out, 0, "  ");
+  out << "}" << std::endl;
+}
+
+template <class KType, class AType>
+void DecisionProgram<KType,AType>::emitStep(std::ostream &out, uint32_t step, const std::string &indent) const
+{
+  const Step &s = steps[step];
+  switch (s.kind) {
+  case LEAF:
+    out << indent << "return " << s.first << ";" << std::endl;
+    break;
+  case COMPARE:
+    out << indent << "if (key <= ";
+    emitKey(out, s.pivot);
+    out << ") {" << std::endl;
+    emitStep(out, s.first, indent + "  ");
+    out << indent << "}" << std::endl;
+    emitStep(out, s.second, indent);
+    break;
+  case TABLE:
+    out << indent << "static const uint32_t table_" << step << "[] = {";
+    for (size_t i = s.first; i < s.first + s.second; ++i)
+      out << (i > s.first ? ", " : "") << table[i];
+    out << "};" << std::endl
+        << indent << "return table_" << step << "[(uint64_t)key - (uint64_t)";
+    emitKey(out, s.pivot);
+    out << "];" << std::endl;
+    break;
+  case BITS:
+    for (uint32_t i = s.first; i + 1 < s.first + s.second; ++i) {
+      out << indent << "if ((0x" << std::hex << masks[i].bits << std::dec
+          << "ULL >> ((uint64_t)key - (uint64_t)";
+      emitKey(out, s.pivot);
+      out << ")) & 1)" << std::endl
+          << indent << "  return " << masks[i].id << ";" << std::endl;
+    }
+    out << indent << "return " << masks[s.first + s.second - 1].id << ";" << std::endl;
+    break;
+  }
+}
+
+/* writes 'key' as a literal: chars must not be printed as characters */
+template <class KType, class AType>
+void DecisionProgram<KType,AType>::emitKey(std::ostream &out, const KType &key)
+{
+  if (!std::numeric_limits<KType>::is_signed)
+    out << (unsigned long long)key << "ULL";
+  else if (key == std::numeric_limits<KType>::min() && key != 0)
+    // the literal of the smallest value would overflow before the minus
+    out << "(" << (long long)(key + 1) << "LL - 1)";
+  else
+    out << (long long)key << "LL";
+}
+
+#endif /* CODEGEN_HPP_INCLUDED */
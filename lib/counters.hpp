@@ -0,0 +1,129 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COUNTERS_HPP_INCLUDED
+#define COUNTERS_HPP_INCLUDED
+
+#include <stddef.h>
+#if defined(LIBRANGE_COUNTERS) && __cplusplus >= 201103L
+#include <atomic>
+#endif
+
+/* Process-wide event counters, for all the Ranges of any type. They
+ * are only collected when LIBRANGE_COUNTERS is defined before librange
+ * is included; otherwise they stay at 0 and cost nothing. With C++11
+ * they are atomic, so that parallel merges count correctly; before
+ * C++11, counts taken while intersectParallel() runs are unreliable.
+ * LIBRANGE_COUNTERS changes the layout of RangeCounters, so it must be
+ * defined, or not, for the whole program: translation units that
+ * disagree break the one definition rule.
+ */
+struct RangeCounters
+{
+#if defined(LIBRANGE_COUNTERS) && __cplusplus >= 201103L
+  typedef std::atomic<size_t> counter_t;
+#else
+  typedef size_t counter_t;
+#endif
+
+  counter_t nodes_allocated;
+  counter_t nodes_released;
+  counter_t merges;          // calls to TreeMerger::merge()
+  counter_t merger_calls;    // actions merged, through a MergeCache or not
+  counter_t merge_depth;     // deepest recursion of TreeMerger::merge()
+  counter_t pruned;          // sub-merges and values dropped as out of bounds
+  counter_t optimizations;   // calls to optimize(), and the ones that
+  counter_t optimized_out;   // replaced the node
+  counter_t lookups;         // calls to Range::find()
+  counter_t lookup_steps;    // OpNode(s) visited by them
+
+  static const bool enabled =
+#ifdef LIBRANGE_COUNTERS
+    true;
+#else
+    false;
+#endif
+
+  static RangeCounters& get() {
+    static RangeCounters counters;
+    return counters;
+  }
+
+  void reset() {
+    nodes_allocated = 0;
+    nodes_released = 0;
+    merges = 0;
+    merger_calls = 0;
+    merge_depth = 0;
+    pruned = 0;
+    optimizations = 0;
+    optimized_out = 0;
+    lookups = 0;
+    lookup_steps = 0;
+  }
+
+  RangeCounters() { reset(); }
+
+#ifdef LIBRANGE_COUNTERS
+  // the depth of the merge running on the calling thread
+  static size_t& currentDepth() {
+#if __cplusplus >= 201103L
+    static thread_local size_t depth = 0;
+#else
+    static __thread size_t depth = 0;
+#endif
+    return depth;
+  }
+
+  /* Tracks the recursion of TreeMerger::merge() while in scope */
+  struct DepthGuard {
+    DepthGuard() {
+      const size_t depth = ++currentDepth();
+#if __cplusplus >= 201103L
+      // other threads may raise the maximum between the load and the
+      // store, so retry until ours is stored or is no longer the largest
+      size_t seen = get().merge_depth.load();
+      while (depth > seen && !get().merge_depth.compare_exchange_weak(seen, depth))
+        ;
+#else
+      if (depth > get().merge_depth)
+        get().merge_depth = depth;
+#endif
+    }
+    ~DepthGuard() { --currentDepth(); }
+  };
+#endif
+
+private:
+  RangeCounters(const RangeCounters&);
+  RangeCounters& operator=(const RangeCounters&);
+};
+
+#ifdef LIBRANGE_COUNTERS
+#define RANGE_COUNT(counter) (++RangeCounters::get().counter)
+#define RANGE_COUNT_N(counter, n) (RangeCounters::get().counter += (n))
+#define RANGE_COUNT_DEPTH() RangeCounters::DepthGuard range_depth_guard
+#else
+#define RANGE_COUNT(counter) ((void)0)
+#define RANGE_COUNT_N(counter, n) ((void)0)
+#define RANGE_COUNT_DEPTH() ((void)0)
+#endif
+
+#endif /* COUNTERS_HPP_INCLUDED */
@@ -0,0 +1,165 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DIRECT_HPP_INCLUDED
+#define DIRECT_HPP_INCLUDED
+
+#include <limits>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include "common.h"
+#include "internals.hpp"
+
+/* The distance of 'key' from 'base', for integral keys; Ranges with
+ * other keys never have a DirectIndex, but still need to compile */
+template <class KType, bool integral = std::numeric_limits<KType>::is_integer>
+struct KeyOffset
+{
+  static uint64_t between(const KType &key, const KType &base) { return 0; }
+};
+
+template <class KType>
+struct KeyOffset<KType, true>
+{
+  static uint64_t between(const KType &key, const KType &base) {
+    return (uint64_t)key - (uint64_t)base;
+  }
+};
+
+/* The actions of all the integral keys in [lo, hi], one slot per key, so
+ * that a lookup is a single load. Slots hold ids into a table of the
+ * actions, so that changing actions only touches that table. It is kept
+ * up to date by its Range: addRange() paints the slots it covers, any
+ * other change to the mappings refills it from scratch.
+ */
+template <class KType, class AType>
+class DirectIndex
+{
+public:
+  DirectIndex(KType lo, KType hi) : lo(lo), hi(hi) {
+    if (!std::numeric_limits<KType>::is_integer || hi < lo)
+      abort(); // only a non-empty domain of integral keys can be indexed
+    ids.resize(offset(hi) + 1, 0);
+  }
+
+  inline bool covers(const KType &key) const { return !(key < lo) && !(hi < key); }
+  inline AType find(const KType &key) const { return actions[ids[offset(key)]]; }
+  size_t entries() const { return ids.size(); }
+  // about how much memory the index takes, itself included
+  size_t bytes() const {
+    return sizeof(*this) + ids.size() * sizeof(uint32_t) + actions.size() * sizeof(AType)
+      + known.size() * (sizeof(std::pair<const AType,uint32_t>) + 4 * sizeof(void*));
+  }
+
+  // sets all the slots from the segments of 'lin'
+  void fill(const Linearization<KType,AType> &lin) {
+    known.clear();
+    actions.clear();
+    size_t slot = 0;
+    for (size_t i = 0; i < lin.actions.size() && slot < ids.size(); ++i) {
+      size_t end = ids.size();
+      if (i < lin.cuts.size())
+        end = slotsBelow(lin.cuts[i]);
+      if (end <= slot)
+        continue;
+      const uint32_t id = idOf(lin.actions[i]);
+      for (; slot < end; ++slot)
+        ids[slot] = id;
+    }
+  }
+
+  // the same as Range::addRange(), restricted to the slots
+  void paint(RangeOperator_t op, const KType &key, const AType &action) {
+    size_t first = 0, end = 0;
+    switch (op) {
+    case LESS_THAN:
+      end = slotsBelow(Cut<KType>(key, false));
+      break;
+    case LESS_EQUAL_THAN:
+      end = slotsBelow(Cut<KType>(key, true));
+      break;
+    case GREAT_THAN:
+      first = slotsBelow(Cut<KType>(key, true));
+      end = ids.size();
+      break;
+    case GREAT_EQUAL_THAN:
+      first = slotsBelow(Cut<KType>(key, false));
+      end = ids.size();
+      break;
+    case EQUAL:
+      if (covers(key)) {
+        first = offset(key);
+        end = first + 1;
+      }
+      break;
+    case INVALID:
+    default:
+      abort();
+    }
+    if (first >= end)
+      return;
+    const uint32_t id = idOf(action);
+    for (size_t slot = first; slot < end; ++slot)
+      ids[slot] = id;
+  }
+
+  // 'change' replaces an action in place, as in TreeNode::changeActions()
+  template <class Change>
+  void changeActions(Change &change) {
+    known.clear();
+    for (size_t i = 0; i < actions.size(); ++i) {
+      change(actions[i]);
+      // two ids can now share their action: either one will do
+      known.insert(std::make_pair(actions[i], (uint32_t)i));
+    }
+  }
+
+private:
+  KType lo, hi;
+  std::vector<uint32_t> ids;
+  std::vector<AType> actions;
+  std::map<AType,uint32_t> known;
+
+  inline size_t offset(const KType &key) const {
+    return (size_t)KeyOffset<KType>::between(key, lo);
+  }
+
+  // the number of slots whose key lies below 'cut'
+  size_t slotsBelow(const Cut<KType> &cut) const {
+    if (cut.below(hi))
+      return ids.size();
+    if (!cut.below(lo))
+      return 0;
+    // lo < cut <= hi, so the key of the cut is in the domain
+    return (cut.incl ? offset(cut.key) + 1 : offset(cut.key));
+  }
+
+  uint32_t idOf(const AType &action) {
+    typename std::map<AType,uint32_t>::iterator i = known.find(action);
+    if (i != known.end())
+      return i->second;
+    known.insert(std::make_pair(action, (uint32_t)actions.size()));
+    actions.push_back(action);
+    return (uint32_t)(actions.size() - 1);
+  }
+};
+
+#endif /* DIRECT_HPP_INCLUDED */
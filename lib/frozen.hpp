@@ -0,0 +1,163 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+ 
+ This file is part of librange.
+ 
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ 
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FROZEN_HPP_INCLUDED
+#define FROZEN_HPP_INCLUDED
+
+#include <limits>
+#include <vector>
+#include "common.h"
+#include "internals.hpp"
+#include "batch.hpp"
+
+/* A read-only snapshot of a Range, meant to be queried many times.
+ * The tree is flattened in a sorted array of cuts, so that each lookup
+ * is a single binary search over contiguous memory.
+ */
+template <class KType, class AType>
+class FrozenRange
+{
+public:
+  FrozenRange(const Linearization<KType,AType> &lin);
+  AType find(KType key) const;
+  void findBatch(const KType *in, size_t n, AType *out) const;
+  void classifyBatch(const KType *in, size_t n, uint32_t *ids) const;
+  size_t segments() const { return actions.size(); }
+  const AType& action(uint32_t id) const { return actions[id]; }
+
+private:
+  // cut i is (keys[i], incl[i]); actions has one element more than keys
+  std::vector<KType> keys;
+  std::vector<char> incl;
+  std::vector<AType> actions;
+  // integral keys only: the cuts as "key > threshold" tests on 32-bit
+  // lanes; 'skipped' cuts lie below every possible key
+  std::vector<int32_t> thresholds;
+  uint32_t skipped;
+
+  inline size_t segmentOf(const KType &key) const;
+  void buildThresholds();
+};
+
+
+/* == template implementation follows == */
+template <class KType, class AType>
+FrozenRange<KType,AType>::FrozenRange(const Linearization<KType,AType> &lin)
+{
+  // neighbouring segments with the same action only cost comparisons
+  Linearization<KType,AType> compact(lin);
+  compact.coalesce();
+  if (compact.actions.size() != compact.cuts.size() + 1)
+    abort(); // only a whole tree can be frozen
+
+  keys.reserve(compact.cuts.size());
+  incl.reserve(compact.cuts.size());
+  for (size_t i = 0; i < compact.cuts.size(); ++i) {
+    keys.push_back(compact.cuts[i].key);
+    incl.push_back(compact.cuts[i].incl);
+  }
+  actions.swap(compact.actions);
+  buildThresholds();
+}
+
+template <class KType, class AType>
+void FrozenRange<KType,AType>::buildThresholds()
+{
+  skipped = 0;
+  if (!KeyLanes<KType>::enabled)
+    return;
+
+  thresholds.reserve(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    int32_t lane = KeyLanes<KType>::toLane(keys[i]);
+    // a key lies above (k, true) if it is > k, above (k, false) if it is > k-1
+    if (incl[i])
+      thresholds.push_back(lane);
+    else if (lane != std::numeric_limits<int32_t>::min())
+      thresholds.push_back(lane - 1);
+    else
+      ++skipped; // only the first cut can be "< min"
+  }
+}
+
+/* returns the index of the first segment whose upper cut lies above 'key' */
+template <class KType, class AType>
+inline size_t FrozenRange<KType,AType>::segmentOf(const KType &key) const
+{
+  size_t lo = 0, hi = keys.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (key < keys[mid] || (incl[mid] && key == keys[mid]))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+/* returns the action associated with the provided key */
+template <class KType, class AType>
+AType FrozenRange<KType,AType>::find(KType key) const
+{
+  return actions[segmentOf(key)];
+}
+
+/* stores in ids[i] the segment of in[i]; ids can be mapped back to
+ * actions through action() */
+template <class KType, class AType>
+void FrozenRange<KType,AType>::classifyBatch(const KType *in, size_t n, uint32_t *ids) const
+{
+  if (!KeyLanes<KType>::enabled) {
+    for (size_t i = 0; i < n; ++i)
+      ids[i] = (uint32_t)segmentOf(in[i]);
+    return;
+  }
+
+  // keys are converted to lanes a chunk at a time, to stay in L1
+  int32_t lanes[256];
+  for (size_t done = 0; done < n; ) {
+    size_t chunk = (n - done < 256 ? n - done : 256);
+    for (size_t i = 0; i < chunk; ++i)
+      lanes[i] = KeyLanes<KType>::toLane(in[done + i]);
+    BatchLookup::classify(thresholds.empty() ? NULL : &thresholds[0], thresholds.size(),
+                          lanes, chunk, ids + done);
+    if (skipped)
+      for (size_t i = 0; i < chunk; ++i)
+        ids[done + i] += skipped;
+    done += chunk;
+  }
+}
+
+/* stores in out[i] the action associated with in[i]; this is the batch
+ * lookup of the library: freeze() a Range once, then look up batches of
+ * keys in the snapshot for as long as the Range is not changed */
+template <class KType, class AType>
+void FrozenRange<KType,AType>::findBatch(const KType *in, size_t n, AType *out) const
+{
+  uint32_t ids[256];
+  for (size_t done = 0; done < n; done += 256) {
+    size_t chunk = (n - done < 256 ? n - done : 256);
+    classifyBatch(in + done, chunk, ids);
+    for (size_t i = 0; i < chunk; ++i)
+      out[done + i] = actions[ids[i]];
+  }
+}
+
+#endif /* FROZEN_HPP_INCLUDED */
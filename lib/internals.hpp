@@ -25,9 +25,18 @@
 #define __attribute__(a)
 #endif
 
+#include <algorithm>
 #include <map>
+#include <new>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
 #include <stdlib.h>
 #include "common.h"
+#include "arena.hpp"
+#include "counters.hpp"
+#include "parallel.hpp"
 
 enum Node_t
   {
@@ -36,57 +45,287 @@ enum Node_t
     PUNCTUAL
   };
 
-template <class KType, class AType>
-class TreeMerger; // fwd decl
+/* A Cut splits the key space in two parts: the keys lying below it
+ * and the ones lying above it. 'key' itself lies below the cut if and
+ * only if 'incl' is set; therefore "< x" corresponds to (x, false)
+ * and "<= x" to (x, true).
+ */
+template <class KType>
+struct Cut
+{
+  KType key;
+  bool incl;
+
+  Cut() : key(), incl(false) {}
+  Cut(KType key, bool incl) : key(key), incl(incl) {}
 
+  inline bool below(const KType &k) const {
+    return (k < key || (incl && k == key));
+  }
+  inline bool operator<(const Cut &other) const {
+    if (key < other.key)
+      return true;
+    if (other.key < key)
+      return false;
+    return (!incl && other.incl);
+  }
+  inline bool operator==(const Cut &other) const {
+    return (key == other.key && incl == other.incl);
+  }
+};
+
+/* The flat representation of a tree: a strictly increasing sequence of
+ * cuts, plus the action of each segment between them. actions[i] is
+ * associated to the keys lying above cuts[i-1] and below cuts[i]; when
+ * there is one action more than cuts, the last one covers all the keys
+ * above the last cut.
+ */
 template <class KType, class AType>
-class TreeNode
+struct Linearization
 {
-  friend class TreeMerger<KType, AType>;
+  std::vector<Cut<KType> > cuts;
+  std::vector<AType> actions;
+  // lower bound of the first segment, if any
+  const Cut<KType> *floor;
+
+  Linearization() : floor(NULL) {}
+
+  // Close the current segment at 'hi' (or at +infinity when 'hi' is
+  // NULL), associating it to 'action'. Empty segments are discarded.
+  void append(const Cut<KType> *hi, const AType &action) {
+    if (hi) {
+      const Cut<KType> *last = (cuts.empty() ? floor : &cuts.back());
+      if (last && !(*last < *hi))
+        return;
+      cuts.push_back(*hi);
+    }
+    actions.push_back(action);
+  }
+
+  // Merge adjacent segments that are associated to the same action
+  void coalesce() {
+    size_t j = 0;
+    for (size_t i = 0; i < cuts.size(); ++i) {
+      if (j > 0 && actions[j-1] == actions[i]) {
+        cuts[j-1] = cuts[i];
+        continue;
+      }
+      cuts[j] = cuts[i];
+      actions[j] = actions[i];
+      ++j;
+    }
+    if (actions.size() > cuts.size()) {
+      // the open-ended tail segment
+      if (j > 0 && actions[j-1] == actions.back())
+        --j;
+      else
+        actions[j] = actions.back();
+      cuts.resize(j);
+      actions.resize(j+1);
+    } else {
+      cuts.resize(j);
+      actions.resize(j);
+    }
+  }
+};
+
+/* The shape of a tree: the depth of its deepest leaf, counting the
+ * OpNode(s) above it, the number of segments its leaves make up, and
+ * the number of its nodes, in total and of each type. A node shared
+ * by several parents is counted once for each of them. */
+struct TreeShape
+{
+  size_t depth;
+  size_t segments;
+  size_t nodes;
+  size_t actions;
+  size_t ranges;
+  size_t puncts;
+  // the punctual values held by all the PunctOpNode(s)
+  size_t punct_entries;
+  // the sum of the depths of all the segments
+  size_t depth_sum;
+
+  TreeShape() : depth(0), segments(0), nodes(0), actions(0), ranges(0), puncts(0),
+                punct_entries(0), depth_sum(0) {}
+
+  inline void leaf(size_t at_depth, size_t n_segments) {
+    if (at_depth > depth)
+      depth = at_depth;
+    segments += n_segments;
+    depth_sum += at_depth * n_segments;
+  }
+};
+
+/* Replaces the actions found in 'mappings', leaving the others alone:
+ * the change of Range::changeActions(mappings) */
+template <class AType>
+struct MapChange
+{
+  const std::map<AType,AType> *mappings;
 
+  MapChange(const std::map<AType,AType> *mappings) : mappings(mappings) {}
+  inline void operator()(AType &action) const {
+    typename std::map<AType,AType>::const_iterator i = mappings->find(action);
+    if (i != mappings->end())
+      action = i->second;
+  }
+};
+
+/* Replaces each action with what 'mapper' returns for it */
+template <class AType, class Mapper>
+struct MapperChange
+{
+  Mapper *mapper;
+
+  MapperChange(Mapper *mapper) : mapper(mapper) {}
+  inline void operator()(AType &action) const {
+    action = (*mapper)(static_cast<const AType&>(action));
+  }
+};
+
+/* The callbacks of the function pointer API of traverse(), any of which
+ * can be NULL, as a visitor for TreeNode::traverse() */
+template <class KType, class AType>
+struct FunctionVisitor
+{
   typedef void(*range_callback_func_t)(RangeOperator_t, KType, void*);
   typedef void(*punt_callback_func_t)(RangeOperator_t, const std::map<KType,AType>&, void*);
   typedef void(*action_callback_func_t)(AType, void*);
 
+  range_callback_func_t range_callback;
+  punt_callback_func_t punt_callback;
+  action_callback_func_t action_callback;
+  void *extra_info;
+
+  FunctionVisitor(range_callback_func_t range_callback, punt_callback_func_t punt_callback,
+                  action_callback_func_t action_callback, void *extra_info)
+    : range_callback(range_callback), punt_callback(punt_callback),
+      action_callback(action_callback), extra_info(extra_info) {}
+
+  void range(RangeOperator_t op, const KType &key) {
+    if (range_callback) (*range_callback)(op, key, extra_info);
+  }
+  void punct(RangeOperator_t op, const std::map<KType,AType> &others) {
+    if (punt_callback) (*punt_callback)(op, others, extra_info);
+  }
+  void action(const AType &action) {
+    if (action_callback) (*action_callback)(action, extra_info);
+  }
+};
+
+/* Any three callables, as a visitor for TreeNode::traverse() */
+template <class KType, class AType, class RangeCallback, class PuntCallback, class ActionCallback>
+struct CallableVisitor
+{
+  RangeCallback *range_callback;
+  PuntCallback *punt_callback;
+  ActionCallback *action_callback;
+
+  CallableVisitor(RangeCallback *range_callback, PuntCallback *punt_callback, ActionCallback *action_callback)
+    : range_callback(range_callback), punt_callback(punt_callback), action_callback(action_callback) {}
+
+  inline void range(RangeOperator_t op, const KType &key) { (*range_callback)(op, key); }
+  inline void punct(RangeOperator_t op, const std::map<KType,AType> &others) { (*punt_callback)(op, others); }
+  inline void action(const AType &action) { (*action_callback)(action); }
+};
+
+template <class KType, class AType>
+class TreeMerger; // fwd decl
+template <class KType, class AType>
+class NodeArena; // fwd decl
+template <class KType, class AType>
+class PunctOpNode; // fwd decl
+template <class KType, class AType>
+class TreeBuilder; // fwd decl
+template <class KType, class AType>
+class TreeOverlay; // fwd decl
+template <class KType, class AType>
+class SegmentIterator; // fwd decl
+
+/* The set of node types is closed: each TreeNode carries its Node_t,
+ * and the methods below dispatch on it with a switch and a static_cast
+ * to the concrete class, which provides a method with the same name.
+ * There are no virtual functions, and no RTTI is needed.
+ */
+template <class KType, class AType>
+class TreeNode
+{
+  friend class TreeMerger<KType, AType>;
+
 public:
-  virtual TreeNode* clone() const = 0;
-  virtual Node_t getType() const = 0;
-  virtual AType find(KType key) const = 0;
-  virtual void grabAllActions(std::set<AType>* actions) const = 0;
-  virtual void traverse(range_callback_func_t range_callback, punt_callback_func_t punt_callback, action_callback_func_t action_callback, void *extra_info) const = 0;
+  inline Node_t getType() const { return type; }
+  AType find(KType key) const;
+  // about how many key comparisons find() makes for 'key': one for each
+  // RangeOpNode, log2 of the map size for each PunctOpNode
+  size_t comparisons(KType key) const;
+  void grabAllActions(std::set<AType>* actions) const;
+  // Accumulate in 'shape' the leaves of this subtree, whose root lies at 'depth'
+  void measure(size_t depth, TreeShape &shape) const;
+  // Call visitor.range(op, separator), visitor.punct(op, punctual values)
+  // and visitor.action(action) on this subtree, in pre-order
+  template <class Visitor>
+  void traverse(Visitor &visitor) const;
+  // Append to 'out', in key order, the segments of this subtree that lie
+  // between the cuts 'lo' and 'hi' (NULL means unbounded)
+  void linearize(const Cut<KType> *lo, const Cut<KType> *hi, Linearization<KType,AType> &out) const;
   // The action of changing actions might optimize the internal tree on the fly.
-  // Therefore, the most current version of the subtree must always be returned and used
-  virtual TreeNode* changeActions(const std::map<AType,AType> &mappings) __attribute__ ((warn_unused_result)) = 0;
+  // Therefore, the most current version of the subtree must always be returned and used,
+  // while the nodes that are optimized out are given back to 'arena'
+  // 'change' is called on each action to replace it in place (see MapChange).
+  template <class Change>
+  TreeNode* changeActions(Change &change, NodeArena<KType,AType> *arena) __attribute__ ((warn_unused_result));
   // Give a chance to each TreeNode to optimize itself (hopefully reducing its complexity)
   // By default, do nothing.
-  virtual TreeNode* optimize() __attribute__ ((warn_unused_result)) { return this; }
+  TreeNode* optimize(NodeArena<KType,AType> *arena) __attribute__ ((warn_unused_result));
+
+protected:
+  TreeNode(Node_t type) : type(type), refs(1) {}
+  // nodes are only destroyed through their concrete type, by NodeArena
+  ~TreeNode() {}
+
+private:
+  friend class NodeArena<KType, AType>;
+
+  Node_t type;
+  // the number of parents (or Ranges) pointing to this node; a node
+  // with more than one can be read, but never modified in place
+  unsigned refs;
 };
 
 
 template <class KType, class AType>
 class ActionNode : public TreeNode<KType,AType>
 {
+  friend class TreeNode<KType, AType>;
   friend class TreeMerger<KType, AType>;
-
-  typedef void(*range_callback_func_t)(RangeOperator_t, KType, void*);
-  typedef void(*punt_callback_func_t)(RangeOperator_t, const std::map<KType,AType>&, void*);
-  typedef void(*action_callback_func_t)(AType, void*);
+  friend class PunctOpNode<KType, AType>;
+  friend class NodeArena<KType, AType>;
+  friend class TreeOverlay<KType, AType>;
+  friend class SegmentIterator<KType, AType>;
 
 public:
-  ActionNode(AType action) : action(action){}
-  virtual ActionNode* clone() const { return new ActionNode(action); }
-  Node_t getType() const { return ACTION; }
+  ActionNode(const AType &action) : TreeNode<KType,AType>(ACTION), action(action){}
+#if __cplusplus >= 201103L
+  ActionNode(AType &&action) : TreeNode<KType,AType>(ACTION), action(std::move(action)){}
+#endif
   AType find(KType key) const {return action;}
   AType getAction() const {return action;}
   void grabAllActions(std::set<AType>* actions) const {actions->insert(action);}
-  void traverse(range_callback_func_t range_callback, punt_callback_func_t punt_callback, action_callback_func_t action_callback, void *extra_info) const
-  { if (action_callback) (*action_callback)(action, extra_info); }
-
-  TreeNode<KType,AType>* changeActions(const std::map<AType,AType> &mappings) {
-    typename std::map<AType,AType>::const_iterator i = mappings.find(action);
-    if(i != mappings.end()) {
-      action = i->second;
-    }
+  void measure(size_t depth, TreeShape &shape) const {
+    ++shape.nodes;
+    ++shape.actions;
+    shape.leaf(depth, 1);
+  }
+  template <class Visitor>
+  void traverse(Visitor &visitor) const
+  { visitor.action(action); }
+  void linearize(const Cut<KType> *lo, const Cut<KType> *hi, Linearization<KType,AType> &out) const
+  { out.append(hi, action); }
+
+  template <class Change>
+  TreeNode<KType,AType>* changeActions(Change &change, NodeArena<KType,AType> *arena) {
+    change(action);
     return this;
   }
 
@@ -99,11 +338,9 @@ template <class KType, class AType>
 class OpNode : public TreeNode<KType,AType>
 {
   friend class TreeMerger<KType, AType>;
+  friend class TreeOverlay<KType, AType>;
 
 public:
-  virtual OpNode* clone() const = 0;
-  static OpNode* buildOpNode(AType dfl_action, RangeOperator_t op, KType key, AType cond_action);
-  virtual void addRange(RangeOperator_t op, KType key, AType cond_action) = 0;
   inline RangeOperator_t getOp() const {return op;}
   inline RangeOperator_t getNormalizedOp() const {
     if (op == LESS_THAN || op == GREAT_EQUAL_THAN)
@@ -116,51 +353,28 @@ public:
 protected:
   TreeNode<KType,AType> *dfl_node;
   RangeOperator_t op;
+
+  OpNode(Node_t type) : TreeNode<KType,AType>(type) {}
 };
 
 
 template <class KType, class AType>
 class RangeOpNode : public OpNode<KType,AType>
 {
+  friend class TreeNode<KType, AType>;
+  friend class TreeBuilder<KType, AType>;
   friend class TreeMerger<KType, AType>;
-
-  typedef void(*range_callback_func_t)(RangeOperator_t, KType, void*);
-  typedef void(*punt_callback_func_t)(RangeOperator_t, const std::map<KType,AType>&, void*);
-  typedef void(*action_callback_func_t)(AType, void*);
+  friend class NodeArena<KType, AType>;
+  friend class TreeOverlay<KType, AType>;
+  friend class SegmentIterator<KType, AType>;
 
 public:
-  RangeOpNode(AType outside_action)
-    : range_node(NULL)
-  {
-    this->dfl_node = new ActionNode<KType,AType>(outside_action);
-    this->op = INVALID;
-  }
-
-  RangeOpNode* clone() const {
-    RangeOpNode *result = new RangeOpNode(this->dfl_node->clone());
-    result->op = this->op;
-    result->range_separator = this->range_separator;
-    result->range_node = this->range_node->clone();
-
-    return result;
-  }
-
-  Node_t getType() const { return RANGE; }
-
-  void addRange(RangeOperator_t op, KType key, AType cond_action)
-  {
-    if (op == EQUAL || op == INVALID)
-      abort();
-
-    if (range_node != NULL)
-      return; // ignore the tentative
-
-    this->op = op;
-    range_separator = key;
-    range_node = new ActionNode<KType,AType>(cond_action);
+  AType find(KType key) const {
+    return child(key)->find(key);
   }
 
-  AType find(KType key) const {
+  // returns the child that 'key' falls into
+  inline const TreeNode<KType,AType>* child(const KType &key) const {
     bool res;
     switch(this->op){
     case LESS_THAN:
@@ -181,10 +395,7 @@ public:
       abort();      
     }
 
-    if(res)
-      return range_node->find(key);
-
-    return this->dfl_node->find(key);
+    return (res ? range_node : this->dfl_node);
   }
 
   void grabAllActions(std::set<AType>* actions) const {
@@ -192,29 +403,49 @@ public:
     range_node->grabAllActions(actions);
   }
 
-  void traverse(range_callback_func_t range_callback, punt_callback_func_t punt_callback, action_callback_func_t action_callback, void *extra_info) const
+  void measure(size_t depth, TreeShape &shape) const {
+    ++shape.nodes;
+    ++shape.ranges;
+    this->dfl_node->measure(depth + 1, shape);
+    range_node->measure(depth + 1, shape);
+  }
+
+  template <class Visitor>
+  void traverse(Visitor &visitor) const
+  {
+    visitor.range(this->op, range_separator);
+
+    this->range_node->traverse(visitor);
+    this->dfl_node->traverse(visitor);
+  }
+
+  void linearize(const Cut<KType> *lo, const Cut<KType> *hi, Linearization<KType,AType> &out) const
   {
-    if (range_callback)
-      (*range_callback)(this->op, range_separator,  extra_info);
+    const Cut<KType> sep(range_separator, this->getNormalizedOp() == LESS_EQUAL_THAN);
 
-    this->range_node->traverse(range_callback, punt_callback, action_callback, extra_info);
-    this->dfl_node->traverse(range_callback, punt_callback, action_callback, extra_info);
+    // skip the sides that fall completely out of (lo, hi)
+    if (!lo || *lo < sep)
+      left_interval()->linearize(lo, (hi && !(sep < *hi) ? hi : &sep), out);
+    if (!hi || sep < *hi)
+      right_interval()->linearize((lo && !(*lo < sep) ? lo : &sep), hi, out);
   }
 
-  TreeNode<KType,AType>* changeActions(const std::map<AType,AType> &mappings) {
-    this->dfl_node = this->dfl_node->changeActions(mappings);
-    range_node = range_node->changeActions(mappings);
+  template <class Change>
+  TreeNode<KType,AType>* changeActions(Change &change, NodeArena<KType,AType> *arena) {
+    this->dfl_node = this->dfl_node->changeActions(change, arena);
+    range_node = range_node->changeActions(change, arena);
 
     // try to optimize this RangeOpNode, if both ranges are ActionNode with the same action
     if(this->dfl_node->getType() == ACTION && range_node->getType() == ACTION) {
-      ActionNode<KType,AType> *dfl_node_as_actnode = dynamic_cast<ActionNode<KType, AType>*>(this->dfl_node);
-      ActionNode<KType,AType> *range_node_as_actnode = dynamic_cast<ActionNode<KType, AType>*>(range_node);
+      ActionNode<KType,AType> *dfl_node_as_actnode = static_cast<ActionNode<KType, AType>*>(this->dfl_node);
+      ActionNode<KType,AType> *range_node_as_actnode = static_cast<ActionNode<KType, AType>*>(range_node);
 
-      if(dfl_node_as_actnode == NULL || range_node_as_actnode == NULL) abort(); // something is wrong
-
-      if(dfl_node_as_actnode->getAction() == range_node_as_actnode->getAction())
+      if(dfl_node_as_actnode->getAction() == range_node_as_actnode->getAction()) {
         // the optimization is possible! return just one of the nodes (they're equal)
+        arena->release(range_node_as_actnode);
+        arena->release(this);
         return dfl_node_as_actnode;
+      }
     }
 
     return this;
@@ -224,8 +455,9 @@ private:
   KType range_separator;
   TreeNode<KType,AType> *range_node;
 
+  // RangeOpNode(s) are only built through NodeArena::newRange()
   RangeOpNode(TreeNode<KType,AType> *dfl_node)
-    : range_node(NULL)
+    : OpNode<KType,AType>(RANGE), range_node(NULL)
   {
     this->dfl_node = dfl_node; 
     this->op = INVALID;
@@ -246,45 +478,27 @@ private:
       return this->dfl_node;
     return this->range_node;
   }
+
+  // the same as above, as assignable pointers
+  inline TreeNode<KType,AType>*& left_slot() {
+    return (this->op == LESS_THAN || this->op == LESS_EQUAL_THAN ? range_node : this->dfl_node);
+  }
+  inline TreeNode<KType,AType>*& right_slot() {
+    return (this->op == LESS_THAN || this->op == LESS_EQUAL_THAN ? this->dfl_node : range_node);
+  }
 };
 
 
 template <class KType, class AType>
 class PunctOpNode : public OpNode<KType,AType>
 {
+  friend class TreeNode<KType, AType>;
   friend class TreeMerger<KType, AType>;
-
-  typedef void(*range_callback_func_t)(RangeOperator_t, KType, void*);
-  typedef void(*punt_callback_func_t)(RangeOperator_t, const std::map<KType,AType>&, void*);
-  typedef void(*action_callback_func_t)(AType, void*);
+  friend class NodeArena<KType, AType>;
+  friend class TreeOverlay<KType, AType>;
+  friend class SegmentIterator<KType, AType>;
 
 public:
-  PunctOpNode(AType default_action)
-  {
-    this->dfl_node = new ActionNode<KType,AType>(default_action);
-    this->op = INVALID;
-  }
-
-  PunctOpNode* clone() const {
-    PunctOpNode *result = new PunctOpNode(this->dfl_node->clone());
-    result->op = this->op;
-    result->others = this->others;
-
-    return result;
-  }
-
-  Node_t getType() const { return PUNCTUAL; }
-
-  void addRange(RangeOperator_t op, KType key, AType cond_action)
-  {
-    if (op != EQUAL)
-      abort();
-
-    this->op = op;
-
-    addPuntAction(key, cond_action);
-  }
-
   AType find(KType key) const {
     typename std::map<KType,AType>::const_iterator i = others.find(key);
     if (i == others.end())
@@ -300,23 +514,50 @@ public:
       actions->insert(i->second);
   }
 
-  void traverse(range_callback_func_t range_callback, punt_callback_func_t punt_callback, action_callback_func_t action_callback, void *extra_info) const
+  void measure(size_t depth, TreeShape &shape) const {
+    // each punctual value splits a segment of the default in two, and adds itself
+    ++shape.nodes;
+    ++shape.puncts;
+    shape.punct_entries += others.size();
+    shape.leaf(depth + 1, 2 * others.size());
+    this->dfl_node->measure(depth + 1, shape);
+  }
+
+  template <class Visitor>
+  void traverse(Visitor &visitor) const
   {
-    if (punt_callback){
-      (*punt_callback)(this->op, others, extra_info);
-    }
+    visitor.punct(this->op, others);
 
-    this->dfl_node->traverse(range_callback, punt_callback, action_callback, extra_info);
+    this->dfl_node->traverse(visitor);
   }
 
-  TreeNode<KType, AType>* changeActions(const std::map<AType,AType> &mappings) {
-    this->dfl_node = this->dfl_node->changeActions(mappings);
+  void linearize(const Cut<KType> *lo, const Cut<KType> *hi, Linearization<KType,AType> &out) const
+  {
+    const AType dfl_action = dflAction();
+
+    // each punctual value is a segment of its own, bounded by
+    // the cuts immediately below and above its key
+    for (typename std::map<KType,AType>::const_iterator i = others.begin();
+         i != others.end();
+         ++i) {
+      if (lo && lo->below(i->first))
+        continue;
+      if (hi && !hi->below(i->first))
+        break;
+      const Cut<KType> before(i->first, false), after(i->first, true);
+      out.append(&before, dfl_action);
+      out.append(&after, i->second);
+    }
+    out.append(hi, dfl_action);
+  }
+
+  template <class Change>
+  TreeNode<KType, AType>* changeActions(Change &change, NodeArena<KType,AType> *arena) {
+    this->dfl_node = this->dfl_node->changeActions(change, arena);
 
     // on-the-fly optimization: discard punctual values whose action is the same
     // of the (possibly new) default action
-    ActionNode<KType, AType> *dfl_prom_action = dynamic_cast<ActionNode<KType, AType>*>(this->dfl_node);
-    if (!dfl_prom_action) abort(); // something broke
-    AType dfl_action = dfl_prom_action->getAction();
+    const AType &dfl_action = dflAction();
 
     for (typename std::map<KType,AType>::iterator i = others.begin();
          i != others.end();
@@ -325,41 +566,27 @@ public:
       // will lose any meaning and I will not be able to increment it
       typename std::map<KType,AType>::iterator i_copy = i++;
 
-      typename std::map<AType,AType>::const_iterator j = mappings.find(i_copy->second);
-      if(j != mappings.end()) {
-        // this punctual value should be converted
-        KType tmp = i_copy->first;
+      change(i_copy->second);
+      if (i_copy->second == dfl_action)
         others.erase(i_copy);
-        if(j->second != dfl_action)
-          // avoid to add a punctual value if its action is the same of the default one
-          others[tmp] = j->second;
-      }
-      else {
-        // This punctual value should not be converted.
-        // Just check for redundancy against dfl_action, then.
-        if (i_copy->second == dfl_action)
-          others.erase(i_copy);
-      }
     }
 
     // Did I manage to optimize out the whole list of punctual values?
     if(others.size()==0)
-      return this->dfl_node;
+      return releaseKeepingDefault(arena);
 
     return this;
   }
 
-  TreeNode<KType, AType>* optimize() {
+  TreeNode<KType, AType>* optimize(NodeArena<KType,AType> *arena) {
     // Goal of the optimization: remove all punctual values whose action
     // is the same of dfl_node. In the case that no punctual values remain
     // at all, return the dfl_node itself.
 
     if(others.size()==0) // easier than expected
-      return this->dfl_node;
+      return releaseKeepingDefault(arena);
 
-    const ActionNode<KType, AType> *dfl_prom_action = dynamic_cast<ActionNode<KType, AType>*>(this->dfl_node);
-    if (!dfl_prom_action) abort(); // something broke
-    const AType dfl_action = dfl_prom_action->getAction();
+    const AType dfl_action = dflAction();
 
     for(typename std::map<KType,AType>::iterator i = others.begin();
         i != others.end();
@@ -373,7 +600,7 @@ public:
 
     // Did I manage to optimize out the whole list of punctual values?
     if(others.size()==0)
-      return this->dfl_node;
+      return releaseKeepingDefault(arena);
 
     return this;
   }
@@ -383,65 +610,253 @@ private:
   // the AType(s), rather than connecting to ActionNode(s) or TreeNode(s)
   std::map<KType,AType> others;
 
+  // PunctOpNode(s) are only built through NodeArena::newPunct()
   PunctOpNode(TreeNode<KType,AType> *dfl_node)
+    : OpNode<KType,AType>(PUNCTUAL)
   {
     this->dfl_node = dfl_node; 
+    this->op = INVALID;
+  }
+
+  // PunctOpNode(s) are leaves, so dfl_node is always an ActionNode
+  inline const AType& dflAction() const {
+    if (this->dfl_node->getType() != ACTION) abort(); // something broke
+    return static_cast<const ActionNode<KType, AType>*>(this->dfl_node)->action;
+  }
+
+  // gives this node back to 'arena' and returns its (surviving) dfl_node
+  TreeNode<KType,AType>* releaseKeepingDefault(NodeArena<KType,AType> *arena) {
+    TreeNode<KType,AType> *dfl = this->dfl_node;
+    arena->release(this);
+    return dfl;
   }
 
   void addPuntAction(KType key, AType action){
     // on the fly optimization: if 'action' is the same of dfl_node, skip this insertion
-    ActionNode<KType, AType> *dfl_prom_action = dynamic_cast<ActionNode<KType, AType>*>(this->dfl_node);
-    if (!dfl_prom_action) abort(); // something broke
-    if ( dfl_prom_action->getAction() == action )
+    if ( dflAction() == action )
       return;
 
     others[key]=action;
   }
 };
 
+/* Every node of a tree is allocated from the NodeArena of the Range
+ * that owns it. Destroying the arena destroys all its nodes at once.
+ * Copies of a Range share its arena and its nodes: a node is counted
+ * once for each parent pointing to it, and it is copied by unshare()
+ * before being modified while shared.
+ */
 template <class KType, class AType>
-class TreeMerger
+class NodeArena
+{
+public:
+  NodeArena() : users(1) {}
+
+  // the Ranges using this arena; the last one to leave deletes it
+  void join() { ++users; }
+  bool leave() { return --users == 0; }
+
+  // adds a parent to 'node'
+  TreeNode<KType,AType>* share(TreeNode<KType,AType> *node) {
+    ++node->refs;
+    return node;
+  }
+
+  // returns 'node' itself if it has a single parent, otherwise a copy
+  // of it (sharing its children) that takes the place of 'node' for the
+  // caller
+  TreeNode<KType,AType>* unshare(TreeNode<KType,AType> *node) {
+    if (node->refs == 1)
+      return node;
+    --node->refs;
+    switch (node->getType()) {
+    case ACTION:
+      return newAction(static_cast<ActionNode<KType,AType>*>(node)->action);
+    case RANGE:
+      {
+        RangeOpNode<KType,AType> *from = static_cast<RangeOpNode<KType,AType>*>(node);
+        RangeOpNode<KType,AType> *copy = newRange(share(from->dfl_node));
+        copy->op = from->op;
+        copy->range_separator = from->range_separator;
+        copy->range_node = (from->range_node ? share(from->range_node) : NULL);
+        return copy;
+      }
+    case PUNCTUAL:
+      {
+        PunctOpNode<KType,AType> *from = static_cast<PunctOpNode<KType,AType>*>(node);
+        PunctOpNode<KType,AType> *copy = newPunct(share(from->dfl_node));
+        copy->op = from->op;
+        copy->others = from->others;
+        return copy;
+      }
+    default:
+      abort();
+    }
+  }
+
+  ActionNode<KType,AType>* newAction(const AType &action) {
+    RANGE_COUNT(nodes_allocated);
+    return new (actions.allocate()) ActionNode<KType,AType>(action);
+  }
+#if __cplusplus >= 201103L
+  // installs a freshly merged action without copying it
+  ActionNode<KType,AType>* newAction(AType &&action) {
+    RANGE_COUNT(nodes_allocated);
+    return new (actions.allocate()) ActionNode<KType,AType>(std::move(action));
+  }
+#endif
+  RangeOpNode<KType,AType>* newRange(TreeNode<KType,AType> *dfl_node) {
+    RANGE_COUNT(nodes_allocated);
+    return new (ranges.allocate()) RangeOpNode<KType,AType>(dfl_node);
+  }
+  PunctOpNode<KType,AType>* newPunct(TreeNode<KType,AType> *dfl_node) {
+    RANGE_COUNT(nodes_allocated);
+    return new (puncts.allocate()) PunctOpNode<KType,AType>(dfl_node);
+  }
+
+  // gives back a single node; its children are left untouched
+  void release(TreeNode<KType,AType> *node) {
+    RANGE_COUNT(nodes_released);
+    switch (node->getType()) {
+    case ACTION:
+      actions.release(static_cast<ActionNode<KType,AType>*>(node));
+      break;
+    case RANGE:
+      ranges.release(static_cast<RangeOpNode<KType,AType>*>(node));
+      break;
+    case PUNCTUAL:
+      puncts.release(static_cast<PunctOpNode<KType,AType>*>(node));
+      break;
+    default:
+      abort();
+    }
+  }
+
+  // drops a parent of 'node'; when none is left, gives back 'node'
+  // and drops it as a parent of its children
+  void releaseTree(TreeNode<KType,AType> *node) {
+    if (--node->refs > 0)
+      return;
+    switch (node->getType()) {
+    case RANGE:
+      releaseTree(static_cast<RangeOpNode<KType,AType>*>(node)->range_node);
+      releaseTree(static_cast<RangeOpNode<KType,AType>*>(node)->dfl_node);
+      break;
+    case PUNCTUAL:
+      releaseTree(static_cast<PunctOpNode<KType,AType>*>(node)->dfl_node);
+      break;
+    default:
+      ;
+    }
+    release(node);
+  }
+
+  size_t liveNodes() const {
+    return actions.liveObjects() + ranges.liveObjects() + puncts.liveObjects();
+  }
+
+  // makes room for a tree with the given number of nodes of each kind,
+  // with at most one allocation per kind
+  void reserve(size_t n_actions, size_t n_ranges) {
+    actions.reserve(n_actions);
+    ranges.reserve(n_ranges);
+  }
+
+  // takes over all the nodes of 'other', which is left empty
+  void adopt(NodeArena &other) {
+    actions.adopt(other.actions);
+    ranges.adopt(other.ranges);
+    puncts.adopt(other.puncts);
+  }
+
+private:
+  unsigned users;
+  Pool<ActionNode<KType,AType> > actions;
+  Pool<RangeOpNode<KType,AType> > ranges;
+  Pool<PunctOpNode<KType,AType> > puncts;
+};
+
+
+/* The merger of the function pointer API, as a callable */
+template <class AType>
+struct FunctionMerger
 {
   typedef AType(*merger_func_t)(const AType, const AType, void*);
 
+  merger_func_t merger;
+  void *extra_info;
+
+  FunctionMerger(merger_func_t merger, void *extra_info) : merger(merger), extra_info(extra_info) {}
+  inline AType operator()(const AType &a, const AType &b) const { return (*merger)(a, b, extra_info); }
+};
+
+/* Everything a merge needs, besides the two trees. 'Merger' is any
+ * callable taking two const AType& and returning the merged AType; the
+ * merges are templates over it, so that it can be inlined. */
+template <class KType, class AType, class Merger = FunctionMerger<AType> >
+struct MergeContext
+{
+  Merger *merger;
+  // the merged nodes are allocated from here
+  NodeArena<KType,AType> *arena;
+
+  // when 'pool' is set, sub-merges are forked as tasks down to
+  // 'fork_depth' levels; each worker allocates from its own arena,
+  // arenas[WorkPool::currentWorker()]
+  WorkPool *pool;
+  NodeArena<KType,AType> **arenas;
+  int fork_depth;
+
+  MergeContext(Merger *merger, NodeArena<KType,AType> *arena)
+    : merger(merger), arena(arena), pool(NULL), arenas(NULL), fork_depth(0) {}
+
+  inline AType merge(const AType &a, const AType &b) const {
+    RANGE_COUNT(merger_calls);
+    return (*merger)(a, b);
+  }
+};
+
+
+template <class KType, class AType>
+class TreeMerger
+{
 public:
+  template <class Merger>
   static TreeNode<KType, AType>* merge(const TreeNode<KType, AType> *a, const TreeNode<KType, AType> *b,
-                                       merger_func_t merger, void *extra_info,
+                                       const MergeContext<KType,AType,Merger> &ctx,
                                        const KType *bound_low, const bool bl_incl,
                                        const KType *bound_high, const bool bh_incl)
   {
+    RANGE_COUNT(merges);
+    RANGE_COUNT_DEPTH();
     Node_t a_type = a->getType();
     Node_t b_type = b->getType();
 
     // handle immediately the easiest cases
     if (a_type == ACTION && b_type == ACTION) {
-      const ActionNode<KType, AType> *a_prom_action = dynamic_cast<const ActionNode<KType, AType>*>(a);
-      const ActionNode<KType, AType> *b_prom_action = dynamic_cast<const ActionNode<KType, AType>*>(b);
-      if (!a_prom_action || !b_prom_action) abort(); // something broke
-      AType m = (*merger)(a_prom_action->action, b_prom_action->action, extra_info);
-      return new ActionNode<KType, AType>(m);
+      const ActionNode<KType, AType> *a_prom_action = static_cast<const ActionNode<KType, AType>*>(a);
+      const ActionNode<KType, AType> *b_prom_action = static_cast<const ActionNode<KType, AType>*>(b);
+      return ctx.arena->newAction(ctx.merge(a_prom_action->action, b_prom_action->action));
     }
 
     // I prefer to have more 'complex' types in 'a' rather than in 'b',
     // so swap them if necessary
     if ( (b_type == RANGE && a_type != RANGE) ||
          (b_type == PUNCTUAL && a_type == ACTION) )
-      return merge(b, a, merger, extra_info, bound_low, bl_incl, bound_high, bh_incl);
+      return merge(b, a, ctx, bound_low, bl_incl, bound_high, bh_incl);
 
     // handle remaining cases
     if (a_type == RANGE) {
       // the left node is a RangeOpNode
-      const RangeOpNode<KType, AType> *a_prom_range = dynamic_cast<const RangeOpNode<KType, AType>*>(a);
-      if (!a_prom_range) abort(); // something broke
+      const RangeOpNode<KType, AType> *a_prom_range = static_cast<const RangeOpNode<KType, AType>*>(a);
 
-      RangeOpNode<KType, AType> *result_range = NULL;
+      TreeNode<KType, AType> *result_range = NULL;
       switch(b_type){
       case RANGE:
         {
           // the right node is a RangeOpNode
-          const RangeOpNode<KType, AType> *b_prom_range = dynamic_cast<const RangeOpNode<KType, AType>*>(b);
-          if (!b_prom_range) abort(); // something broke
-          result_range = merge_range_range(a_prom_range, b_prom_range, merger, extra_info,
+          const RangeOpNode<KType, AType> *b_prom_range = static_cast<const RangeOpNode<KType, AType>*>(b);
+          result_range = merge_range_range(a_prom_range, b_prom_range, ctx,
                                            bound_low, bl_incl, bound_high, bh_incl);
           break;
         }
@@ -449,9 +864,8 @@ public:
       case PUNCTUAL:
         {
           // the right node is a PunctOpNode
-          const PunctOpNode<KType, AType> *b_prom_punct = dynamic_cast<const PunctOpNode<KType, AType>*>(b);
-          if (!b_prom_punct) abort(); // something broke
-          result_range = merge_range_punct(a_prom_range, b_prom_punct, merger, extra_info,
+          const PunctOpNode<KType, AType> *b_prom_punct = static_cast<const PunctOpNode<KType, AType>*>(b);
+          result_range = merge_range_punct(a_prom_range, b_prom_punct, ctx,
                                            bound_low, bl_incl, bound_high, bh_incl);
           break;
         }
@@ -460,75 +874,72 @@ public:
         {
           // the right node is a ActionNode
           const RangeOperator_t a_op = a_prom_range->getOp();
-          TreeNode<KType, AType> *dfl_node = NULL;
-          TreeNode<KType, AType> *range_node = NULL;
+          // jobs[0] gives the dfl_node and jobs[1] the range_node
+          MergeJob jobs[2];
           if (a_op == LESS_THAN || a_op == LESS_EQUAL_THAN) {
             // dfl_node must be checked for compatibility against the
             // upper bound and range_node against the lower one
-            if(is_out_of_high_bound(a_prom_range->range_separator,
-                                    bound_high, bh_incl))
-              dfl_node = NULL;
-            else
-              dfl_node = merge(a_prom_range->dfl_node, b, merger, extra_info,
-                               &a_prom_range->range_separator, a_op == LESS_THAN,
-                               bound_high, bh_incl);
-
-            if(is_out_of_low_bound(a_prom_range->range_separator,
-                                   bound_low, bl_incl))
-              range_node = NULL;
-            else
-              range_node = merge(a_prom_range->range_node, b, merger, extra_info,
-                                 bound_low, bl_incl,
-                                 &a_prom_range->range_separator, a_op == LESS_EQUAL_THAN);
+            if(!is_out_of_high_bound(a_prom_range->range_separator,
+                                     bound_high, bh_incl))
+              jobs[0].set(a_prom_range->dfl_node, b,
+                          &a_prom_range->range_separator, a_op == LESS_THAN,
+                          bound_high, bh_incl);
+
+            if(!is_out_of_low_bound(a_prom_range->range_separator,
+                                    bound_low, bl_incl))
+              jobs[1].set(a_prom_range->range_node, b,
+                          bound_low, bl_incl,
+                          &a_prom_range->range_separator, a_op == LESS_EQUAL_THAN);
           } else {
             // ... the opposite :)
-            if(is_out_of_low_bound(a_prom_range->range_separator,
-                                   bound_low, bl_incl))
-              dfl_node = NULL;
-            else
-              dfl_node = merge(a_prom_range->dfl_node, b, merger, extra_info,
-                               bound_low, bl_incl,
-                               &a_prom_range->range_separator, a_op == GREAT_THAN);
-
-            if(is_out_of_high_bound(a_prom_range->range_separator,
-                                    bound_high, bh_incl))
-              range_node = NULL;
-            else
-              range_node = merge(a_prom_range->range_node, b, merger, extra_info,
-                                 &a_prom_range->range_separator, a_op == GREAT_EQUAL_THAN,
-                                 bound_high, bh_incl);
+            if(!is_out_of_low_bound(a_prom_range->range_separator,
+                                    bound_low, bl_incl))
+              jobs[0].set(a_prom_range->dfl_node, b,
+                          bound_low, bl_incl,
+                          &a_prom_range->range_separator, a_op == GREAT_THAN);
+
+            if(!is_out_of_high_bound(a_prom_range->range_separator,
+                                     bound_high, bh_incl))
+              jobs[1].set(a_prom_range->range_node, b,
+                          &a_prom_range->range_separator, a_op == GREAT_EQUAL_THAN,
+                          bound_high, bh_incl);
           }
+          runJobs(jobs, 2, ctx, bound_low, bl_incl, bound_high, bh_incl);
+          TreeNode<KType, AType> *dfl_node = jobs[0].result;
+          TreeNode<KType, AType> *range_node = jobs[1].result;
 
-          // only one among dfl_node or range_node can be out of bounds
+          // either one can be out of bounds, or both
           if (dfl_node == NULL)
             return range_node;
           if (range_node == NULL)
             return dfl_node;
 
-          result_range = new RangeOpNode<KType, AType>(dfl_node);
-          result_range->op = a_prom_range->op;
-          result_range->range_separator = a_prom_range->range_separator;
-          result_range->range_node = range_node;
+          RangeOpNode<KType, AType> *tmp = ctx.arena->newRange(dfl_node);
+          tmp->op = a_prom_range->op;
+          tmp->range_separator = a_prom_range->range_separator;
+          tmp->range_node = range_node;
+          result_range = tmp;
 
           break;
         }
       }
 
-      return result_range->optimize();
+      // the bounds can leave nothing to merge
+      if (!result_range)
+        return NULL;
+      return result_range->optimize(ctx.arena);
     } else if (a_type == PUNCTUAL) {
       // the left node is a PunctOpNode
-      const PunctOpNode<KType, AType> *a_prom_punct = dynamic_cast<const PunctOpNode<KType, AType>*>(a);
-      if (!a_prom_punct) abort(); // something broke
+      const PunctOpNode<KType, AType> *a_prom_punct = static_cast<const PunctOpNode<KType, AType>*>(a);
 
       switch(b_type){
       case PUNCTUAL:
         {
           // the right node is a PunctOpNode
-          const PunctOpNode<KType, AType> *b_prom_punct = dynamic_cast<const PunctOpNode<KType, AType>*>(b);
-          if (!b_prom_punct) abort(); // something broke
-          TreeNode<KType, AType> *res = merge_punct_punct(a_prom_punct, b_prom_punct, merger, extra_info,
+          const PunctOpNode<KType, AType> *b_prom_punct = static_cast<const PunctOpNode<KType, AType>*>(b);
+          TreeNode<KType, AType> *res = merge_punct_punct(a_prom_punct, b_prom_punct, ctx,
                                                           bound_low, bl_incl, bound_high, bh_incl);
-          return res->optimize();
+          return res->optimize(ctx.arena);
         }
 
       case ACTION:
@@ -536,8 +947,8 @@ public:
           // the right node is a ActionNode
           PunctOpNode<KType, AType> *result_punct = NULL;
 
-          TreeNode<KType, AType> *new_dfl_node = merge(a_prom_punct->dfl_node, b, merger, extra_info, bound_low, bl_incl, bound_high, bh_incl);
-          const AType b_action = dynamic_cast<const ActionNode<KType, AType>*>(b)->action;
+          TreeNode<KType, AType> *new_dfl_node = merge(a_prom_punct->dfl_node, b, ctx, bound_low, bl_incl, bound_high, bh_incl);
+          const AType &b_action = static_cast<const ActionNode<KType, AType>*>(b)->action;
 
           for(typename std::map<KType,AType>::const_iterator i = a_prom_punct->others.begin();
               i != a_prom_punct->others.end();
@@ -548,16 +959,16 @@ public:
               continue;
 
             if (!result_punct) {
-              result_punct = new PunctOpNode<KType, AType>(new_dfl_node);
+              result_punct = ctx.arena->newPunct(new_dfl_node);
               result_punct->op = EQUAL;
             }
-            result_punct->others[i->first]=(*merger)(i->second, b_action, extra_info);
+            result_punct->others[i->first]=ctx.merge(i->second, b_action);
           }
 
           if (!result_punct) // boundaries prevented me from adding any value to result_punct
             return new_dfl_node;
 
-          return result_punct->optimize();
+          return result_punct->optimize(ctx.arena);
         }
 
       default: abort(); // something went wrong
@@ -572,9 +983,109 @@ public:
 
 
 private:
-  static RangeOpNode<KType, AType>* merge_range_range(const RangeOpNode<KType, AType> *a,
+  // a sub-merge that does not depend on its siblings; 'a' is NULL
+  // when it has been skipped
+  struct MergeJob {
+    const TreeNode<KType, AType> *a, *b;
+    const KType *bound_low, *bound_high;
+    bool bl_incl, bh_incl;
+    TreeNode<KType, AType> *result;
+
+    MergeJob() : a(NULL), b(NULL), bound_low(NULL), bound_high(NULL),
+                 bl_incl(false), bh_incl(false), result(NULL) {}
+
+    void set(const TreeNode<KType, AType> *a, const TreeNode<KType, AType> *b,
+             const KType *bound_low, const bool bl_incl,
+             const KType *bound_high, const bool bh_incl) {
+      this->a = a;
+      this->b = b;
+      this->bound_low = bound_low;
+      this->bl_incl = bl_incl;
+      this->bound_high = bound_high;
+      this->bh_incl = bh_incl;
+    }
+
+    // Narrows the bounds of the job to the ones of its parent, which
+    // may be tighter when a separator lies out of them, and skips the
+    // job when no key is left in between: otherwise it would build a
+    // subtree that no lookup can reach, and that later merges copy.
+    void clamp(const KType *low, const bool low_incl, const KType *high, const bool high_incl) {
+      if (low) {
+        if (!bound_low || *bound_low < *low) {
+          bound_low = low;
+          bl_incl = low_incl;
+        } else if (!(*low < *bound_low))
+          bl_incl = bl_incl && low_incl;
+      }
+      if (high) {
+        if (!bound_high || *high < *bound_high) {
+          bound_high = high;
+          bh_incl = high_incl;
+        } else if (!(*bound_high < *high))
+          bh_incl = bh_incl && high_incl;
+      }
+      if (bound_low && bound_high &&
+          (*bound_high < *bound_low ||
+           (!(*bound_low < *bound_high) && !(bl_incl && bh_incl)))) {
+        RANGE_COUNT(pruned);
+        a = NULL;
+      }
+    }
+  };
+
+  template <class Merger>
+  static void runJob(MergeJob &job, const MergeContext<KType,AType,Merger> &ctx) {
+    job.result = merge(job.a, job.b, ctx, job.bound_low, job.bl_incl, job.bound_high, job.bh_incl);
+  }
+
+  /* Runs the jobs in order, or forks all of them but the last one to the
+   * pool of the context, if it has one and the fork depth allows it.
+   * Either way the results are the same. The jobs are first clamped to
+   * the bounds of the merge that spawns them.
+   */
+  template <class Merger>
+  static void runJobs(MergeJob *jobs, const size_t n, const MergeContext<KType,AType,Merger> &ctx,
+                      const KType *bound_low, const bool bl_incl,
+                      const KType *bound_high, const bool bh_incl)
+  {
+    for (size_t i = 0; i < n; ++i)
+      if (jobs[i].a)
+        jobs[i].clamp(bound_low, bl_incl, bound_high, bh_incl);
+
+#if __cplusplus >= 201103L
+    if (ctx.pool && ctx.fork_depth > 0) {
+      MergeContext<KType,AType,Merger> inner(ctx);
+      --inner.fork_depth;
+
+      size_t last = n;
+      while (last > 0 && !jobs[last - 1].a)
+        --last;
+      TaskGroup group(*ctx.pool);
+      for (size_t i = 0; i + 1 < last; ++i) {
+        if (!jobs[i].a)
+          continue;
+        MergeJob *job = &jobs[i];
+        group.run([job, &inner] {
+            MergeContext<KType,AType,Merger> local(inner);
+            local.arena = inner.arenas[WorkPool::currentWorker()];
+            runJob(*job, local);
+          });
+      }
+      if (last > 0)
+        runJob(jobs[last - 1], inner);
+      group.wait();
+      return;
+    }
+#endif
+    for (size_t i = 0; i < n; ++i)
+      if (jobs[i].a)
+        runJob(jobs[i], ctx);
+  }
+
+  template <class Merger>
+  static TreeNode<KType, AType>* merge_range_range(const RangeOpNode<KType, AType> *a,
                                                       const RangeOpNode<KType, AType> *b,
-                                                      merger_func_t merger, void *extra_info,
+                                                      const MergeContext<KType,AType,Merger> &ctx,
                                                       const KType *bound_low, const bool bl_incl,
                                                       const KType *bound_high, const bool bh_incl)
   {
@@ -584,6 +1095,7 @@ private:
     // except when a_separator == b_separator, the intersection
     // between two ranges gives three intervals and two separators
     TreeNode<KType, AType> *int_1=NULL, *int_2=NULL, *int_3=NULL;
+    MergeJob jobs[3];
     RangeOperator_t sep_1=INVALID, sep_2=INVALID;
     KType sep_1_val, sep_2_val;
     if(a_separator == b_separator) {
@@ -594,26 +1106,25 @@ private:
       sep_2 = b->getNormalizedOp();
       sep_1_val = a_separator;
       sep_2_val = a_separator;
-      int_1 = merge(a->left_interval(),
-                    b->left_interval(),
-                    merger, extra_info,
-                    bound_low, bl_incl, &sep_1_val,
-                    sep_1 == LESS_EQUAL_THAN && sep_2 == LESS_EQUAL_THAN);
-      int_3 = merge(a->right_interval(),
-                    b->right_interval(),
-                    merger, extra_info,
-                    &sep_2_val, sep_1 == LESS_THAN && sep_2 == LESS_THAN,
-                    bound_high, bh_incl);
+      jobs[0].set(a->left_interval(),
+                  b->left_interval(),
+                  bound_low, bl_incl, &sep_1_val,
+                  sep_1 == LESS_EQUAL_THAN && sep_2 == LESS_EQUAL_THAN);
+      jobs[2].set(a->right_interval(),
+                  b->right_interval(),
+                  &sep_2_val, sep_1 == LESS_THAN && sep_2 == LESS_THAN,
+                  bound_high, bh_incl);
       if(a->getNormalizedOp() != b->getNormalizedOp()) {
         // there is a small "gap" between the intervals (as in '<x' and '>x')
         // or they are overlapped ('<=x' and '>=x')
         // handle both cases here
+        // the separator itself lies on the left of the '<=' side only
+        const bool a_incl = (a->getNormalizedOp() == LESS_EQUAL_THAN);
         sep_1 = LESS_THAN;
         sep_2 = LESS_EQUAL_THAN;
-        int_2 = merge((sep_1 == LESS_THAN? a->right_interval() : a->left_interval() ),
-                      (sep_1 == LESS_THAN? a->left_interval() : a->right_interval() ),
-                      merger, extra_info,
-                      &sep_1_val, true, &sep_2_val, true);
+        jobs[1].set((a_incl ? a->left_interval() : a->right_interval() ),
+                    (a_incl ? b->right_interval() : b->left_interval() ),
+                    &sep_1_val, true, &sep_2_val, true);
       } 
     } else {
       // a_separator != b_separator
@@ -624,35 +1135,36 @@ private:
       sep_1_val = range_left->range_separator;
       sep_2_val = range_right->range_separator;
 
-      int_1 = (is_out_of_low_bound(sep_1_val, bound_low,
-                                   sep_1 == LESS_EQUAL_THAN && bl_incl)
-               ? NULL :
-               merge(range_left->left_interval(),
-                     range_right->left_interval(),
-                     merger, extra_info,
-                     bound_low, bl_incl, &sep_1_val, sep_1 == LESS_EQUAL_THAN)
-        );
-      int_2 = merge(range_left->right_interval(),
+      if (!is_out_of_low_bound(sep_1_val, bound_low,
+                               sep_1 == LESS_EQUAL_THAN && bl_incl))
+        jobs[0].set(range_left->left_interval(),
                     range_right->left_interval(),
-                    merger, extra_info,
-                    &sep_1_val, sep_1 == LESS_THAN, &sep_2_val, sep_2 == LESS_EQUAL_THAN);
-      int_3 = (is_out_of_high_bound(sep_2_val, bound_low,
-                                    sep_2 == LESS_THAN && bh_incl)
-               ? NULL :
-               merge(range_left->right_interval(),
-                     range_right->right_interval(),
-                     merger, extra_info,
-                     &sep_2_val, sep_2 == LESS_THAN, bound_high, bh_incl)
-        );
-    }
-
-    // From the above, only one among int_1, int_2 or int_3 can be
-    // NULL. I'll act accordingly.
-        
+                    bound_low, bl_incl, &sep_1_val, sep_1 == LESS_EQUAL_THAN);
+      jobs[1].set(range_left->right_interval(),
+                  range_right->left_interval(),
+                  &sep_1_val, sep_1 == LESS_THAN, &sep_2_val, sep_2 == LESS_EQUAL_THAN);
+      if (!is_out_of_high_bound(sep_2_val, bound_high,
+                                sep_2 == LESS_THAN && bh_incl))
+        jobs[2].set(range_left->right_interval(),
+                    range_right->right_interval(),
+                    &sep_2_val, sep_2 == LESS_THAN, bound_high, bh_incl);
+    }
+
+    // the three intervals do not depend on each other
+    runJobs(jobs, 3, ctx, bound_low, bl_incl, bound_high, bh_incl);
+    int_1 = jobs[0].result;
+    int_2 = jobs[1].result;
+    int_3 = jobs[2].result;
+
+    // Any of the intervals can be NULL, when the bounds leave nothing
+    // of it (int_1 and int_3 are both NULL when the bounds lie between
+    // the two separators, so that int_2 alone is left); those that are
+    // left are joined. I'll act accordingly.
+
     // if int_2 == NULL, sep_2 will be ignored
     if (int_2) {
       if (int_3) {
-        RangeOpNode<KType,AType> *tmp = new RangeOpNode<KType,AType>(int_3);
+        RangeOpNode<KType,AType> *tmp = ctx.arena->newRange(int_3);
         tmp->op = sep_2;
         tmp->range_separator = sep_2_val;
         tmp->range_node = int_2;
@@ -663,25 +1175,22 @@ private:
     } else
       int_2 = int_3;
 
-    RangeOpNode<KType, AType> *result;
-    if (int_1) {
-      result = new RangeOpNode<KType,AType>(int_2);
-      result->op = sep_1;
-      result->range_separator = sep_1_val;
-      result->range_node = int_1;
-    }
-    else {
-      // this is always legal because of the code paths above and the
-      // fact that only one among int_1, int_2 and int_3 can be NULL
-      result = dynamic_cast<RangeOpNode<KType, AType> *>(int_2);
-    }
+    if (!int_1)
+      return int_2;
+    if (!int_2)
+      return int_1;
 
+    RangeOpNode<KType, AType> *result = ctx.arena->newRange(int_2);
+    result->op = sep_1;
+    result->range_separator = sep_1_val;
+    result->range_node = int_1;
     return result;
   }
 
-  static RangeOpNode<KType, AType>* merge_range_punct(const RangeOpNode<KType, AType> *a,
+  template <class Merger>
+  static TreeNode<KType, AType>* merge_range_punct(const RangeOpNode<KType, AType> *a,
                                                       const PunctOpNode<KType, AType> *b,
-                                                      merger_func_t merger, void *extra_info,
+                                                      const MergeContext<KType,AType,Merger> &ctx,
                                                       const KType *bound_low, const bool bl_incl,
                                                       const KType *bound_high, const bool bh_incl)
   {
@@ -699,16 +1208,16 @@ private:
     // first skip all the punctual values below the lower bound
     typename std::map<KType,AType>::const_iterator iter;
     for (iter = b->others.begin();
-         is_out_of_low_bound(iter->first, bound_low, bl_incl) &&
-           iter != b->others.end();
+         iter != b->others.end() &&
+           is_out_of_low_bound(iter->first, bound_low, bl_incl);
          ++iter)
       ;
 
     // now separate left-hand punctual values from right-hand ones,
     // bailing out early if going through the upper bound
     bool scanning_left_side = true;
-    for(; !is_out_of_high_bound(iter->first, bound_high, bh_incl) &&
-          iter != b->others.end();
+    for(; iter != b->others.end() &&
+          !is_out_of_high_bound(iter->first, bound_high, bh_incl);
         ++iter) {
       if (scanning_left_side && ( a_norm_op == LESS_THAN ?
                                   iter->first < a_separator :
@@ -716,7 +1225,7 @@ private:
       {
         // the current punctual value must go in the left child
         if (!tmp_child_left) {
-          tmp_child_left = new PunctOpNode<KType, AType>(b->dfl_node);
+          tmp_child_left = ctx.arena->newPunct(b->dfl_node);
           tmp_child_left->op = EQUAL;
         }
         tmp_child_left->addPuntAction(iter->first, iter->second);
@@ -724,7 +1233,7 @@ private:
         // the current punctual value must go in the right child
         scanning_left_side = false;
         if (!tmp_child_right) {
-          tmp_child_right = new PunctOpNode<KType, AType>(b->dfl_node);
+          tmp_child_right = ctx.arena->newPunct(b->dfl_node);
           tmp_child_right->op = EQUAL;
         }
         tmp_child_right->addPuntAction(iter->first, iter->second);
@@ -734,20 +1243,34 @@ private:
     // Actually create the children. Must take care of two things:
     // 1) the orientation of the parent RangeOpNode
     // 2) whether if any of the tmp children is empty
-    TreeNode<KType, AType> *child_left = merge((a_op == LESS_THAN || a_op == LESS_EQUAL_THAN ?
-                                                a->range_node : a->dfl_node ),
-                                               (tmp_child_left? tmp_child_left : b->dfl_node),
-                                               merger, extra_info,
-                                               bound_low, bl_incl,
-                                               &a_separator, a_norm_op == LESS_EQUAL_THAN);
-    TreeNode<KType, AType> *child_right = merge((a_op == LESS_THAN || a_op == LESS_EQUAL_THAN ?
-                                                 a->dfl_node : a->range_node ),
-                                                (tmp_child_right? tmp_child_right : b->dfl_node),
-                                                merger, extra_info,
-                                                &a_separator, a_norm_op == LESS_THAN,
-                                                bound_high, bh_incl);
-
-    result = new RangeOpNode<KType, AType>(child_right);
+    MergeJob jobs[2];
+    jobs[0].set((a_op == LESS_THAN || a_op == LESS_EQUAL_THAN ?
+                 a->range_node : a->dfl_node ),
+                (tmp_child_left? tmp_child_left : b->dfl_node),
+                bound_low, bl_incl,
+                &a_separator, a_norm_op == LESS_EQUAL_THAN);
+    jobs[1].set((a_op == LESS_THAN || a_op == LESS_EQUAL_THAN ?
+                 a->dfl_node : a->range_node ),
+                (tmp_child_right? tmp_child_right : b->dfl_node),
+                &a_separator, a_norm_op == LESS_THAN,
+                bound_high, bh_incl);
+    runJobs(jobs, 2, ctx, bound_low, bl_incl, bound_high, bh_incl);
+    TreeNode<KType, AType> *child_left = jobs[0].result;
+    TreeNode<KType, AType> *child_right = jobs[1].result;
+
+    // the tmp children share b->dfl_node, so they are given back alone
+    if (tmp_child_left)
+      ctx.arena->release(tmp_child_left);
+    if (tmp_child_right)
+      ctx.arena->release(tmp_child_right);
+
+    // a side that lies wholly out of the bounds gives nothing
+    if (!child_left)
+      return child_right;
+    if (!child_right)
+      return child_left;
+
+    result = ctx.arena->newRange(child_right);
     result->op = a_norm_op;
     result->range_separator = a_separator;
     result->range_node = child_left;
@@ -755,18 +1278,19 @@ private:
     return result;
   }
 
+  template <class Merger>
   static TreeNode<KType, AType>* merge_punct_punct(const PunctOpNode<KType, AType> *a,
                                                    const PunctOpNode<KType, AType> *b,
-                                                   merger_func_t merger, void *extra_info,
+                                                   const MergeContext<KType,AType,Merger> &ctx,
                                                    const KType *bound_low, const bool bl_incl,
                                                    const KType *bound_high, const bool bh_incl)
   {
-    const ActionNode<KType, AType> *a_dfl = dynamic_cast<const ActionNode<KType, AType>*>(a->dfl_node);
-    const ActionNode<KType, AType> *b_dfl = dynamic_cast<const ActionNode<KType, AType>*>(b->dfl_node);
-    if (!a_dfl || !b_dfl) abort(); // something broke
+    if (a->dfl_node->getType() != ACTION || b->dfl_node->getType() != ACTION) abort(); // something broke
+    const ActionNode<KType, AType> *a_dfl = static_cast<const ActionNode<KType, AType>*>(a->dfl_node);
+    const ActionNode<KType, AType> *b_dfl = static_cast<const ActionNode<KType, AType>*>(b->dfl_node);
 
-    TreeNode<KType, AType> *merged_dfl = merge(a->dfl_node, b->dfl_node, merger, extra_info, bound_low, bl_incl, bound_high, bh_incl);
-    PunctOpNode<KType, AType> *result = new PunctOpNode<KType, AType>(merged_dfl);
+    TreeNode<KType, AType> *merged_dfl = merge(a->dfl_node, b->dfl_node, ctx, bound_low, bl_incl, bound_high, bh_incl);
+    PunctOpNode<KType, AType> *result = ctx.arena->newPunct(merged_dfl);
     result->op = EQUAL;
     
     typename std::map<KType,AType>::const_iterator a_iter = a->others.begin();
@@ -775,7 +1299,7 @@ private:
       // need to account both the lower and the higher bounds in all subcases
       if( (a_iter->first) < (b_iter->first) ) {
         if(!is_out_of_low_bound(a_iter->first, bound_low, bl_incl))
-          result->others[a_iter->first]=(*merger)(a_iter->second, b_dfl->action, extra_info);
+          result->others[a_iter->first]=ctx.merge(a_iter->second, b_dfl->action);
 
         if(is_out_of_high_bound(a_iter->first, bound_high, bh_incl))
           break; // all the following in both 'a' and 'b' will be out of upper bound
@@ -783,7 +1307,7 @@ private:
         ++a_iter; // advance the iterator
       } else if ( (a_iter->first) > (b_iter->first) ) {
         if(!is_out_of_low_bound(b_iter->first, bound_low, bl_incl))
-          result->others[b_iter->first]=(*merger)(a_dfl->action, b_iter->second, extra_info);
+          result->others[b_iter->first]=ctx.merge(a_dfl->action, b_iter->second);
 
         if(is_out_of_high_bound(b_iter->first, bound_high, bh_incl))
           break; // all the following in both 'a' and 'b' will be out of upper bound
@@ -791,7 +1315,7 @@ private:
         ++b_iter; // advance the iterator
       } else { // if (a_iter->first) == (b_iter->first) )
         if(!is_out_of_low_bound(a_iter->first, bound_low, bl_incl))
-          result->others[a_iter->first]=(*merger)(a_iter->second, b_iter->second, extra_info);
+          result->others[a_iter->first]=ctx.merge(a_iter->second, b_iter->second);
 
         if(is_out_of_high_bound(a_iter->first, bound_high, bh_incl))
           break; // all the following in both 'a' and 'b' will be out of upper bound
@@ -802,16 +1326,16 @@ private:
     }
 
     // add the remaining mappings
-    for (; !is_out_of_high_bound(a_iter->first, bound_high, bh_incl)
-           && a_iter != a->others.end(); ++a_iter)
-      result->others[a_iter->first]=(*merger)(a_iter->second, b_dfl->action, extra_info);
-    for (; !is_out_of_high_bound(b_iter->first, bound_high, bh_incl)
-           && b_iter != b->others.end(); ++b_iter)
-      result->others[b_iter->first]=(*merger)(a_dfl->action, b_iter->second, extra_info);
+    for (; a_iter != a->others.end()
+           && !is_out_of_high_bound(a_iter->first, bound_high, bh_incl); ++a_iter)
+      result->others[a_iter->first]=ctx.merge(a_iter->second, b_dfl->action);
+    for (; b_iter != b->others.end()
+           && !is_out_of_high_bound(b_iter->first, bound_high, bh_incl); ++b_iter)
+      result->others[b_iter->first]=ctx.merge(a_dfl->action, b_iter->second);
 
     if(result->others.size() == 0) {
       // everything was out of bound
-      delete result;
+      ctx.arena->release(result);
       return merged_dfl;
     }
 
@@ -821,44 +1345,617 @@ private:
   inline static bool is_out_of_high_bound(const KType &val, const KType *high_bound,
                                           bool bh_included)
   {
-    return (high_bound &&
-            (bh_included ? (val > *high_bound) : (val >= *high_bound) )
-      );
+    const bool out = (high_bound &&
+                      (bh_included ? (val > *high_bound) : (val >= *high_bound) ));
+    if (out)
+      RANGE_COUNT(pruned);
+    return out;
   }
 
   inline static bool is_out_of_low_bound(const KType &val, const KType *low_bound,
                                           bool bl_included)
   {
-    return (low_bound &&
-            (bl_included ? val < *low_bound : val <= *low_bound)
-      );
+    const bool out = (low_bound &&
+                      (bl_included ? val < *low_bound : val <= *low_bound));
+    if (out)
+      RANGE_COUNT(pruned);
+    return out;
+  }
+};
+
+
+/* Intersects two Linearizations in a single merge-join: each output
+ * segment ends at the nearest of the two current cuts, and the merger
+ * is invoked exactly once for it.
+ */
+template <class KType, class AType>
+class SweepMerger
+{
+  typedef AType(*merger_func_t)(const AType, const AType, void*);
+
+public:
+  static void merge(const Linearization<KType,AType> &a, const Linearization<KType,AType> &b,
+                    merger_func_t merger, void *extra_info,
+                    Linearization<KType,AType> &out)
+  {
+    FunctionMerger<AType> call(merger, extra_info);
+    merge(a, b, call, out);
+  }
+
+  // the same, with any callable taking two const AType&
+  template <class Merger>
+  static void merge(const Linearization<KType,AType> &a, const Linearization<KType,AType> &b,
+                    Merger &merger, Linearization<KType,AType> &out)
+  {
+    // only whole key spaces can be intersected
+    if (a.actions.size() != a.cuts.size() + 1 || b.actions.size() != b.cuts.size() + 1)
+      abort();
+
+    out.cuts.reserve(a.cuts.size() + b.cuts.size());
+    out.actions.reserve(a.cuts.size() + b.cuts.size() + 1);
+    size_t i = 0, j = 0;
+    for (;;) {
+      const AType m = merger(a.actions[i], b.actions[j]);
+      const bool a_done = (i == a.cuts.size());
+      const bool b_done = (j == b.cuts.size());
+      if (a_done && b_done) {
+        out.actions.push_back(m); // the open-ended tail
+        break;
+      }
+
+      if (b_done || (!a_done && a.cuts[i] < b.cuts[j])) {
+        out.cuts.push_back(a.cuts[i++]);
+      } else if (a_done || b.cuts[j] < a.cuts[i]) {
+        out.cuts.push_back(b.cuts[j++]);
+      } else {
+        // same cut on both sides
+        out.cuts.push_back(a.cuts[i++]);
+        ++j;
+      }
+      out.actions.push_back(m);
+    }
+  }
+
+  // Intersects all the Linearizations in 'in' with a single k-way sweep.
+  // The action of each output segment is the left fold of the inputs, as
+  // merger(...merger(merger(in[0], in[1]), in[2])..., in[k-1]); partial
+  // folds are kept, so that crossing a cut of in[i] only recomputes the
+  // merges from i onwards.
+  static void mergeAll(const std::vector<const Linearization<KType,AType>*> &in,
+                       merger_func_t merger, void *extra_info,
+                       Linearization<KType,AType> &out)
+  {
+    const size_t k = in.size();
+    if (k == 0)
+      abort();
+
+    std::vector<size_t> pos(k, 0);
+    std::vector<AType> partial;
+    partial.reserve(k);
+    // pending cuts, the nearest one on top
+    std::priority_queue<std::pair<Cut<KType>, size_t>,
+                        std::vector<std::pair<Cut<KType>, size_t> >,
+                        CutAbove> pending;
+    size_t total = 0;
+    for (size_t i = 0; i < k; ++i) {
+      if (in[i]->actions.size() != in[i]->cuts.size() + 1)
+        abort(); // only whole key spaces can be intersected
+      partial.push_back(i == 0 ? in[0]->actions[0] : (*merger)(partial[i-1], in[i]->actions[0], extra_info));
+      if (!in[i]->cuts.empty())
+        pending.push(std::make_pair(in[i]->cuts[0], i));
+      total += in[i]->cuts.size();
+    }
+    out.cuts.reserve(total);
+    out.actions.reserve(total + 1);
+
+    while (!pending.empty()) {
+      const Cut<KType> cut = pending.top().first;
+      size_t lowest = k;
+      // advance all the inputs that share this cut
+      while (!pending.empty() && pending.top().first == cut) {
+        const size_t i = pending.top().second;
+        pending.pop();
+        if (++pos[i] < in[i]->cuts.size())
+          pending.push(std::make_pair(in[i]->cuts[pos[i]], i));
+        if (i < lowest)
+          lowest = i;
+      }
+
+      out.cuts.push_back(cut);
+      out.actions.push_back(partial[k-1]);
+      for (size_t i = lowest; i < k; ++i)
+        partial[i] = (i == 0 ? in[0]->actions[pos[0]] : (*merger)(partial[i-1], in[i]->actions[pos[i]], extra_info));
+    }
+    out.actions.push_back(partial[k-1]); // the open-ended tail
+  }
+
+private:
+  struct CutAbove {
+    bool operator()(const std::pair<Cut<KType>, size_t> &x, const std::pair<Cut<KType>, size_t> &y) const {
+      return y.first < x.first;
+    }
+  };
+};
+
+/* Builds a height-balanced tree of RangeOpNode(s) out of a
+ * Linearization of the whole key space, bottom-up. Given a weight for
+ * each segment, it builds a weight-balanced tree instead: each cut
+ * splits the weight of its subtree as evenly as possible, so that heavy
+ * segments end up close to the root.
+ */
+template <class KType, class AType>
+class TreeBuilder
+{
+public:
+  static TreeNode<KType,AType>* build(const Linearization<KType,AType> &lin, NodeArena<KType,AType> *arena)
+  {
+    if (lin.actions.empty() || lin.actions.size() != lin.cuts.size() + 1)
+      abort(); // only a whole key space can be built
+    return build(lin, 0, lin.actions.size() - 1, arena);
+  }
+
+  static TreeNode<KType,AType>* build(const Linearization<KType,AType> &lin, const std::vector<double> &weights,
+                                      NodeArena<KType,AType> *arena)
+  {
+    if (lin.actions.empty() || lin.actions.size() != lin.cuts.size() + 1 ||
+        weights.size() != lin.actions.size())
+      abort(); // only a whole key space can be built
+    // prefix[i] is the weight of the segments before segment i
+    std::vector<double> prefix(weights.size() + 1, 0);
+    for (size_t i = 0; i < weights.size(); ++i)
+      prefix[i + 1] = prefix[i] + weights[i];
+    return build(lin, prefix, 0, lin.actions.size() - 1, arena);
+  }
+
+private:
+  // builds the subtree covering segments first..last (both included)
+  static TreeNode<KType,AType>* build(const Linearization<KType,AType> &lin, size_t first, size_t last,
+                                      NodeArena<KType,AType> *arena)
+  {
+    if (first == last)
+      return arena->newAction(lin.actions[first]);
+
+    // cut 'mid' separates segment 'mid' from segment 'mid+1'
+    const size_t mid = first + (last - first) / 2;
+    RangeOpNode<KType,AType> *node = arena->newRange(build(lin, mid + 1, last, arena));
+    node->op = (lin.cuts[mid].incl ? LESS_EQUAL_THAN : LESS_THAN);
+    node->range_separator = lin.cuts[mid].key;
+    node->range_node = build(lin, first, mid, arena);
+    return node;
+  }
+
+  static TreeNode<KType,AType>* build(const Linearization<KType,AType> &lin, const std::vector<double> &prefix,
+                                      size_t first, size_t last, NodeArena<KType,AType> *arena)
+  {
+    if (first == last)
+      return arena->newAction(lin.actions[first]);
+
+    // the first cut leaving at least half of the weight below it, or the
+    // one before, whichever is closer to the half
+    const double half = (prefix[first] + prefix[last + 1]) / 2;
+    size_t mid = std::lower_bound(prefix.begin() + first + 1, prefix.begin() + last + 1, half)
+      - prefix.begin() - 1;
+    if (mid == last)
+      --mid;
+    if (mid > first && half - prefix[mid] < prefix[mid + 1] - half)
+      --mid;
+    RangeOpNode<KType,AType> *node = arena->newRange(build(lin, prefix, mid + 1, last, arena));
+    node->op = (lin.cuts[mid].incl ? LESS_EQUAL_THAN : LESS_THAN);
+    node->range_separator = lin.cuts[mid].key;
+    node->range_node = build(lin, prefix, first, mid, arena);
+    return node;
   }
 };
 
 
+/* Paints an action over a part of the key space of a tree: the keys
+ * below a cut, the keys above it, or a single key. The subtrees that
+ * end up painted over are dropped, so the tree never holds more nodes
+ * than its segments need. The new separator lands at the bottom of a
+ * single path; when that is too deep for the size of the tree, the
+ * lowest subtree along the path that is too unbalanced gets rebuilt,
+ * as in a scapegoat tree, so lookups stay O(log n).
+ * paint() takes over a reference to the node it is given, and returns
+ * a reference to the node taking its place. PunctOpNode(s) are kept
+ * over ActionNode(s), as the merges expect.
+ * graft() paints a half of the key space with a whole subtree instead,
+ * hung where apply() would put the new ActionNode.
+ * 'size' is the size of the tree under 'root', as counted by treeSize(); it
+ * bounds the depth, and is updated to the size of the painted tree. The
+ * caller keeps it, so that painting never walks the whole tree.
+ */
+template <class KType, class AType>
+class TreeOverlay
+{
+public:
+  static TreeNode<KType,AType>* apply(TreeNode<KType,AType> *root, RangeOperator_t op, const KType &key,
+                                      const AType &action, NodeArena<KType,AType> *arena, size_t &size)
+  {
+    Paint p(op, key, &action, arena, size);
+    TreeNode<KType,AType> *painted = start(root, p);
+    size = p.size;
+    return painted;
+  }
+
+  // the keys on the side of 'op' take the actions that 'subtree' maps
+  // them to; takes over a reference to 'subtree' too
+  static TreeNode<KType,AType>* graft(TreeNode<KType,AType> *root, RangeOperator_t op, const KType &key,
+                                      TreeNode<KType,AType> *subtree, NodeArena<KType,AType> *arena, size_t &size)
+  {
+    if (op == EQUAL)
+      abort(); // a single key takes a single action
+    Paint p(op, key, NULL, arena, size);
+    p.subtree = subtree;
+    TreeNode<KType,AType> *painted = start(root, p);
+    size = p.size;
+    return painted;
+  }
+
+  // the nodes of the tree under 'node', and the punctual values it holds
+  static size_t treeSize(const TreeNode<KType,AType> *node)
+  {
+    switch (node->getType()) {
+    case RANGE:
+      {
+        const RangeOpNode<KType,AType> *range = static_cast<const RangeOpNode<KType,AType>*>(node);
+        return 1 + treeSize(range->dfl_node) + treeSize(range->range_node);
+      }
+    case PUNCTUAL:
+      {
+        const PunctOpNode<KType,AType> *punct = static_cast<const PunctOpNode<KType,AType>*>(node);
+        return 1 + punct->others.size() + treeSize(punct->dfl_node);
+      }
+    default:
+      return 1;
+    }
+  }
+
+private:
+  enum Side_t { BELOW, ABOVE, POINT };
+
+  struct Paint {
+    Side_t side;
+    Cut<KType> cut;
+    RangeOperator_t op;
+    // what the painted keys get: 'action', or the keys of 'subtree'
+    const AType *action;
+    TreeNode<KType,AType> *subtree;
+    NodeArena<KType,AType> *arena;
+    // the size of the painted tree, kept up to date while it changes
+    size_t size;
+    size_t max_depth;
+    // set while looking for a subtree to rebuild, going back up
+    bool pending;
+    // the size of the subtree we are coming from, while pending
+    size_t path_size;
+
+    Paint(RangeOperator_t op, const KType &key, const AType *action, NodeArena<KType,AType> *arena, size_t size)
+      : side(POINT), cut(key, true), op(op), action(action), subtree(NULL), arena(arena), size(size),
+        max_depth(2), pending(false), path_size(0) {}
+
+    // a subtree of 'size' nodes was created, its top at 'depth'
+    void created(size_t depth, size_t size) {
+      if (depth + 1 > max_depth) {
+        pending = true;
+        path_size = size;
+      }
+    }
+
+    // whether painting would leave 'other' as it is
+    inline bool same(const AType &other) const { return !subtree && *action == other; }
+  };
+
+  static TreeNode<KType,AType>* start(TreeNode<KType,AType> *root, Paint &p)
+  {
+    switch (p.op) {
+    case LESS_THAN:
+    case LESS_EQUAL_THAN:
+      p.side = BELOW;
+      p.cut = Cut<KType>(p.cut.key, p.op == LESS_EQUAL_THAN);
+      break;
+    case GREAT_THAN:
+    case GREAT_EQUAL_THAN:
+      p.side = ABOVE;
+      p.cut = Cut<KType>(p.cut.key, p.op == GREAT_THAN);
+      break;
+    case EQUAL:
+      p.side = POINT;
+      break;
+    case INVALID:
+    default:
+      abort();
+    }
+    // log_{3/2} of the size of the tree
+    for (double n = (double) p.size; n > 1; n /= 1.5)
+      ++p.max_depth;
+    return paint(root, 0, p);
+  }
+
+  static TreeNode<KType,AType>* paint(TreeNode<KType,AType> *node, size_t depth, Paint &p)
+  {
+    switch (node->getType()) {
+    case ACTION: return paintAction(static_cast<ActionNode<KType,AType>*>(node), depth, p);
+    case RANGE: return paintRange(static_cast<RangeOpNode<KType,AType>*>(node), depth, p);
+    case PUNCTUAL: return paintPunct(static_cast<PunctOpNode<KType,AType>*>(node), depth, p);
+    default: abort();
+    }
+  }
+
+  static TreeNode<KType,AType>* paintAction(ActionNode<KType,AType> *leaf, size_t depth, Paint &p)
+  {
+    if (p.same(leaf->action))
+      return leaf;
+
+    if (p.side == POINT) {
+      PunctOpNode<KType,AType> *punct = p.arena->newPunct(leaf);
+      punct->op = EQUAL;
+      punct->others[p.cut.key] = *p.action;
+      p.size += 2;
+      p.created(depth, 2);
+      return punct;
+    }
+    return newSeparator(leaf, depth, p);
+  }
+
+  static TreeNode<KType,AType>* paintRange(RangeOpNode<KType,AType> *range, size_t depth, Paint &p)
+  {
+    const Cut<KType> sep(range->range_separator, range->getNormalizedOp() == LESS_EQUAL_THAN);
+    bool go_left;
+    switch (p.side) {
+    case BELOW:
+      // when the whole left side is painted over, the right one takes our place
+      if (!(p.cut < sep))
+        return paint(dropKeeping(range, range->right_slot(), p), depth, p);
+      go_left = true;
+      break;
+    case ABOVE:
+      if (!(sep < p.cut))
+        return paint(dropKeeping(range, range->left_slot(), p), depth, p);
+      go_left = false;
+      break;
+    case POINT:
+    default:
+      go_left = sep.below(p.cut.key);
+    }
+
+    range = static_cast<RangeOpNode<KType,AType>*>(p.arena->unshare(range));
+    TreeNode<KType,AType> *&path = (go_left ? range->left_slot() : range->right_slot());
+    TreeNode<KType,AType> *other = (go_left ? range->right_slot() : range->left_slot());
+    path = paint(path, depth + 1, p);
+
+    // both sides might have been left with the same action
+    if (path->getType() == ACTION && other->getType() == ACTION &&
+        static_cast<ActionNode<KType,AType>*>(path)->action == static_cast<ActionNode<KType,AType>*>(other)->action) {
+      p.path_size = 1;
+      return dropKeeping(range, other, p);
+    }
+
+    if (p.pending) {
+      const size_t size = 1 + p.path_size + treeSize(other);
+      if (3 * p.path_size > 2 * size) {
+        p.pending = false;
+        return rebuild(range, p);
+      }
+      p.path_size = size;
+    }
+    return range;
+  }
+
+  static TreeNode<KType,AType>* paintPunct(PunctOpNode<KType,AType> *punct, size_t depth, Paint &p)
+  {
+    if (punct->dfl_node->getType() != ACTION) abort(); // something broke
+    const AType dfl_action = punct->dflAction();
+
+    if (p.side == POINT) {
+      punct = static_cast<PunctOpNode<KType,AType>*>(p.arena->unshare(punct));
+      p.size -= punct->others.size();
+      if (p.same(dfl_action))
+        punct->others.erase(p.cut.key);
+      else
+        punct->others[p.cut.key] = *p.action;
+      p.size += punct->others.size();
+      if (punct->others.empty())
+        return dropKeeping(punct, punct->dfl_node, p);
+      return punct;
+    }
+
+    // the punctual values on the painted side are dropped
+    std::map<KType,AType> kept;
+    for (typename std::map<KType,AType>::const_iterator i = punct->others.begin();
+         i != punct->others.end();
+         ++i)
+      if (p.cut.below(i->first) == (p.side == ABOVE))
+        kept.insert(kept.end(), *i);
+
+    TreeNode<KType,AType> *rest = dropKeeping(punct, punct->dfl_node, p);
+    if (!kept.empty()) {
+      PunctOpNode<KType,AType> *tmp = p.arena->newPunct(rest);
+      tmp->op = EQUAL;
+      p.size += 1 + kept.size();
+      tmp->others.swap(kept);
+      rest = tmp;
+    }
+    if (p.same(dfl_action))
+      return rest; // the painted side needs no separator
+    return newSeparator(rest, depth, p);
+  }
+
+  // a RangeOpNode with the action or the subtree painted on its side, and
+  // 'rest' on the other
+  static RangeOpNode<KType,AType>* newSeparator(TreeNode<KType,AType> *rest, size_t depth, Paint &p)
+  {
+    RangeOpNode<KType,AType> *range = p.arena->newRange(rest);
+    range->op = p.op;
+    range->range_separator = p.cut.key;
+    if (p.subtree)
+      range->range_node = p.subtree;
+    else
+      range->range_node = p.arena->newAction(*p.action);
+    const size_t painted = treeSize(range->range_node);
+    p.size += 1 + painted;
+    p.created(depth, 1 + painted + treeSize(rest));
+    return range;
+  }
+
+  // gives back 'node', except for its child 'keep', which is returned
+  static TreeNode<KType,AType>* dropKeeping(TreeNode<KType,AType> *node, TreeNode<KType,AType> *keep, Paint &p)
+  {
+    // only the dropped side is counted, which is never larger than what
+    // releaseTree() goes through when the nodes are not shared
+    if (node->getType() == RANGE) {
+      const RangeOpNode<KType,AType> *range = static_cast<const RangeOpNode<KType,AType>*>(node);
+      p.size -= 1 + treeSize(range->range_node == keep ? range->dfl_node : range->range_node);
+    } else {
+      p.size -= 1 + static_cast<const PunctOpNode<KType,AType>*>(node)->others.size();
+    }
+    p.arena->share(keep);
+    p.arena->releaseTree(node);
+    return keep;
+  }
+
+  static TreeNode<KType,AType>* rebuild(TreeNode<KType,AType> *node, Paint &p)
+  {
+    Linearization<KType,AType> lin;
+    node->linearize(NULL, NULL, lin);
+    lin.coalesce();
+    TreeNode<KType,AType> *built = TreeBuilder<KType,AType>::build(lin, p.arena);
+    // a node for each cut and one for each segment
+    p.size += lin.cuts.size() + lin.actions.size();
+    p.size -= treeSize(node);
+    p.arena->releaseTree(node);
+    return built;
+  }
+};
+
 /* implementations that needed fwd declarations */
 template <class KType, class AType>
-OpNode<KType,AType>* OpNode<KType,AType>::buildOpNode
-(AType dfl_action, RangeOperator_t op, KType key, AType cond_action)
+AType TreeNode<KType,AType>::find(KType key) const
+{
+  const TreeNode<KType,AType> *node = this;
+  for (;;) {
+    switch (node->type) {
+    case ACTION:
+      return static_cast<const ActionNode<KType,AType>*>(node)->action;
+    case RANGE:
+      RANGE_COUNT(lookup_steps);
+      node = static_cast<const RangeOpNode<KType,AType>*>(node)->child(key);
+      break;
+    case PUNCTUAL:
+      {
+        RANGE_COUNT(lookup_steps);
+        const PunctOpNode<KType,AType> *punct = static_cast<const PunctOpNode<KType,AType>*>(node);
+        typename std::map<KType,AType>::const_iterator i = punct->others.find(key);
+        if (i != punct->others.end())
+          return i->second;
+        node = punct->dfl_node;
+        break;
+      }
+    default:
+      abort();
+    }
+  }
+}
+
+template <class KType, class AType>
+void TreeNode<KType,AType>::grabAllActions(std::set<AType>* actions) const
 {
-  OpNode<KType,AType> *node;
-  switch(op){
-  case LESS_THAN:
-  case LESS_EQUAL_THAN:
-  case GREAT_THAN:
-  case GREAT_EQUAL_THAN:
-    node = new RangeOpNode<KType,AType>(dfl_action);
-    break;
-  case EQUAL:
-    node = new PunctOpNode<KType,AType>(dfl_action);
-    break;
-  case INVALID:
-  default:
-    abort();
-  }
-
-  node->addRange(op, key, cond_action);
-  return node;
+  switch (type) {
+  case ACTION: static_cast<const ActionNode<KType,AType>*>(this)->grabAllActions(actions); break;
+  case RANGE: static_cast<const RangeOpNode<KType,AType>*>(this)->grabAllActions(actions); break;
+  case PUNCTUAL: static_cast<const PunctOpNode<KType,AType>*>(this)->grabAllActions(actions); break;
+  default: abort();
+  }
+}
+
+template <class KType, class AType>
+size_t TreeNode<KType,AType>::comparisons(KType key) const
+{
+  size_t to_ret = 0;
+  const TreeNode<KType,AType> *node = this;
+  for (;;) {
+    switch (node->type) {
+    case ACTION:
+      return to_ret;
+    case RANGE:
+      node = static_cast<const RangeOpNode<KType,AType>*>(node)->child(key);
+      break;
+    case PUNCTUAL:
+      {
+        const PunctOpNode<KType,AType> *punct = static_cast<const PunctOpNode<KType,AType>*>(node);
+        for (size_t n = punct->others.size(); n > 0; n /= 2)
+          ++to_ret;
+        if (punct->others.find(key) != punct->others.end())
+          return to_ret;
+        node = punct->dfl_node;
+        continue;
+      }
+    default:
+      abort();
+    }
+    ++to_ret;
+  }
+}
+
+template <class KType, class AType>
+void TreeNode<KType,AType>::measure(size_t depth, TreeShape &shape) const
+{
+  switch (type) {
+  case ACTION: static_cast<const ActionNode<KType,AType>*>(this)->measure(depth, shape); break;
+  case RANGE: static_cast<const RangeOpNode<KType,AType>*>(this)->measure(depth, shape); break;
+  case PUNCTUAL: static_cast<const PunctOpNode<KType,AType>*>(this)->measure(depth, shape); break;
+  default: abort();
+  }
+}
+
+template <class KType, class AType>
+template <class Visitor>
+void TreeNode<KType,AType>::traverse(Visitor &visitor) const
+{
+  switch (type) {
+  case ACTION: static_cast<const ActionNode<KType,AType>*>(this)->traverse(visitor); break;
+  case RANGE: static_cast<const RangeOpNode<KType,AType>*>(this)->traverse(visitor); break;
+  case PUNCTUAL: static_cast<const PunctOpNode<KType,AType>*>(this)->traverse(visitor); break;
+  default: abort();
+  }
+}
+
+template <class KType, class AType>
+void TreeNode<KType,AType>::linearize(const Cut<KType> *lo, const Cut<KType> *hi, Linearization<KType,AType> &out) const
+{
+  switch (type) {
+  case ACTION: static_cast<const ActionNode<KType,AType>*>(this)->linearize(lo, hi, out); break;
+  case RANGE: static_cast<const RangeOpNode<KType,AType>*>(this)->linearize(lo, hi, out); break;
+  case PUNCTUAL: static_cast<const PunctOpNode<KType,AType>*>(this)->linearize(lo, hi, out); break;
+  default: abort();
+  }
+}
+
+template <class KType, class AType>
+template <class Change>
+TreeNode<KType,AType>* TreeNode<KType,AType>::changeActions(Change &change, NodeArena<KType,AType> *arena)
+{
+  // shared nodes are copied before being changed
+  TreeNode *self = arena->unshare(this);
+  switch (type) {
+  case ACTION: return static_cast<ActionNode<KType,AType>*>(self)->changeActions(change, arena);
+  case RANGE: return static_cast<RangeOpNode<KType,AType>*>(self)->changeActions(change, arena);
+  case PUNCTUAL: return static_cast<PunctOpNode<KType,AType>*>(self)->changeActions(change, arena);
+  default: abort();
+  }
+}
+
+template <class KType, class AType>
+TreeNode<KType,AType>* TreeNode<KType,AType>::optimize(NodeArena<KType,AType> *arena)
+{
+  RANGE_COUNT(optimizations);
+  // only PunctOpNode(s) know how to optimize themselves
+  if (type == PUNCTUAL) {
+    TreeNode<KType,AType> *to_ret = static_cast<PunctOpNode<KType,AType>*>(this)->optimize(arena);
+    if (to_ret != this)
+      RANGE_COUNT(optimized_out);
+    return to_ret;
+  }
+  return this;
 }
 
 #endif /* INTERNALS_HPP_INCLUDED */
@@ -0,0 +1,154 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef INTERNED_HPP_INCLUDED
+#define INTERNED_HPP_INCLUDED
+
+#include <map>
+#include <set>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include "range.hpp"
+
+/* Maps each distinct action to a dense 32-bit id, handed out in order
+ * of first appearance. A table is meant to be shared by many
+ * InternedRange(s), and must outlive them.
+ */
+template <class AType>
+class ActionTable
+{
+public:
+  typedef uint32_t ActionId;
+
+  ActionId intern(const AType &action) {
+    typename std::map<AType,ActionId>::iterator i = ids.lower_bound(action);
+    if (i != ids.end() && !(action < i->first))
+      return i->second;
+    const ActionId id = (ActionId) actions.size();
+    actions.push_back(action);
+    ids.insert(i, std::make_pair(action, id));
+    return id;
+  }
+
+  // whether 'action' was interned, and its id in 'id' if so
+  bool lookup(const AType &action, ActionId &id) const {
+    typename std::map<AType,ActionId>::const_iterator i = ids.find(action);
+    if (i == ids.end())
+      return false;
+    id = i->second;
+    return true;
+  }
+
+  inline const AType& action(ActionId id) const { return actions[id]; }
+  size_t size() const { return actions.size(); }
+
+private:
+  std::vector<AType> actions; // indexed by id
+  std::map<AType,ActionId> ids;
+};
+
+
+/* A Range whose trees store the ids of an ActionTable instead of
+ * copies of the actions. Leaves and punctual values hold 32-bit ids,
+ * so the optimizations comparing actions compare integers, while the
+ * lookups still hand back AType(s).
+ * Only InternedRange(s) built on the same table can be intersected.
+ */
+template <class KType, class AType>
+class InternedRange
+{
+public:
+  typedef typename ActionTable<AType>::ActionId ActionId;
+  typedef AType(*merger_func_t)(const AType, const AType, void*);
+
+  InternedRange(ActionTable<AType> &table, const AType &dfl_action)
+    : table(&table), range(table.intern(dfl_action)) {}
+
+  void addRange(RangeOperator_t op, KType key, const AType &action) {
+    range.addRange(op, key, table->intern(action));
+  }
+  // by value: interning more actions can move those of the table
+  AType find(KType key) const { return table->action(range.find(key)); }
+  ActionId findId(KType key) const { return range.find(key); }
+
+  std::set<AType> findAll() const {
+    const std::vector<bool> used = findAllIds();
+    std::set<AType> to_ret;
+    for (size_t id = 0; id < used.size(); ++id)
+      if (used[id])
+        to_ret.insert(table->action((ActionId) id));
+    return to_ret;
+  }
+
+  // a bitset over the ids of the table: true for the reachable actions
+  std::vector<bool> findAllIds() const {
+    const std::set<ActionId> ids = range.findAll();
+    std::vector<bool> used(table->size(), false);
+    for (typename std::set<ActionId>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+      used[*i] = true;
+    return used;
+  }
+
+  void changeActions(const std::map<AType,AType> &mappings) {
+    std::map<ActionId,ActionId> id_mappings;
+    ActionId from;
+    // an action that was never interned is in no tree, so it is not mapped
+    for (typename std::map<AType,AType>::const_iterator i = mappings.begin(); i != mappings.end(); ++i)
+      if (table->lookup(i->first, from))
+        id_mappings[from] = table->intern(i->second);
+    range.changeActions(id_mappings);
+  }
+
+  /* the merger still sees actions; each result is interned on the fly */
+  static InternedRange intersect(const InternedRange &a, const InternedRange &b, merger_func_t merger, void *extra_info) {
+    if (a.table != b.table)
+      abort(); // ids from different tables cannot be mixed
+    MergeThrough through = { a.table, merger, extra_info };
+    return InternedRange(a.table, Range<KType,ActionId>::intersect(a.range, b.range, &mergeIds, &through));
+  }
+
+  ActionTable<AType>& getTable() const { return *table; }
+  // the underlying Range of ids, e.g. to freeze it
+  const Range<KType,ActionId>& ids() const { return range; }
+
+private:
+  ActionTable<AType> *table;
+  Range<KType,ActionId> range;
+
+  InternedRange(ActionTable<AType> *table, const Range<KType,ActionId> &range)
+    : table(table), range(range) {}
+
+  struct MergeThrough {
+    ActionTable<AType> *table;
+    merger_func_t merger;
+    void *extra_info;
+  };
+
+  static ActionId mergeIds(const ActionId a, const ActionId b, void *extra_info) {
+    MergeThrough *through = static_cast<MergeThrough*>(extra_info);
+    return through->table->intern((*through->merger)(through->table->action(a),
+                                                     through->table->action(b),
+                                                     through->extra_info));
+  }
+};
+
+#endif /* INTERNED_HPP_INCLUDED */
@@ -0,0 +1,218 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAZY_HPP_INCLUDED
+#define LAZY_HPP_INCLUDED
+
+#include <set>
+#include "cache.hpp"
+#include "internals.hpp"
+
+template <class KType, class AType>
+class Range;
+
+/* An intersection of Ranges that is only computed as far as it is
+ * queried. Each operand is either a Range, held as a copy that shares
+ * its nodes, or another LazyRange, so expressions compose:
+ *
+ *   LazyRange<int,int> e = Range<int,int>::lazyIntersect(
+ *     Range<int,int>::lazyIntersect(a, b, m1), c, m2);
+ *
+ * find() looks the key up in each operand and merges the actions found
+ * there; no tree is built. findAll() and materialize() sweep the
+ * flattened operands instead, calling the merger once for each distinct
+ * pair of actions that meet on some segment; the flattened result is
+ * kept, so that later calls on the same expression, and the find() of
+ * keys below it, reuse it.
+ * Those results are cached behind const methods, so a LazyRange must not
+ * be queried from several threads at once. The merger gets the actions
+ * of the left operand first.
+ */
+template <class KType, class AType>
+class LazyRange
+{
+public:
+  // an expression made of 'range' alone
+  LazyRange(const Range<KType,AType> &range) : root(new Leaf(range)) {}
+  LazyRange(const LazyRange &other) : root(other.root) { ++root->refs; }
+  LazyRange& operator=(const LazyRange &other) {
+    ++other.root->refs;
+    Node::release(root);
+    root = other.root;
+    return *this;
+  }
+  ~LazyRange() { Node::release(root); }
+
+  // the same as Range::lazyIntersect()
+  template <class Merger>
+  static LazyRange intersect(const LazyRange &a, const LazyRange &b, Merger merger) {
+    return LazyRange(new Merge<Merger>(a.root, b.root, merger));
+  }
+
+  // the action the intersection associates to 'key'
+  AType find(KType key) const { return root->find(key); }
+  // the actions of the intersection, including its default action, as
+  // Range::findAll() returns them
+  std::set<AType> findAll() const { return root->findAll(); }
+  // the intersection as a Range, built out of balanced segments; a lone
+  // Range operand is returned as it is
+  Range<KType,AType> materialize() const { return root->materialize(); }
+  // whether findAll() or materialize() computed the whole intersection
+  bool evaluated() const { return root->evaluated(); }
+
+private:
+  /* an expression, shared by all the LazyRange(s) and the Merge(s) that
+   * refer to it */
+  class Node
+  {
+  public:
+    size_t refs;
+    // what the intersection of the default actions gives
+    AType dfl_action;
+
+    Node(const AType &dfl_action) : refs(1), dfl_action(dfl_action) {}
+    virtual ~Node() {}
+
+    virtual AType find(const KType &key) const = 0;
+    virtual std::set<AType> findAll() const = 0;
+    virtual Range<KType,AType> materialize() const = 0;
+    virtual bool evaluated() const = 0;
+    // the coalesced segments of the whole key space
+    virtual const Linearization<KType,AType>& flat() const = 0;
+
+    static void release(Node *node) {
+      if (--node->refs == 0)
+        delete node;
+    }
+
+  private:
+    Node(const Node&);
+    Node& operator=(const Node&);
+  };
+
+  class Leaf : public Node
+  {
+  public:
+    Leaf(const Range<KType,AType> &range) : Node(range.default_action), range(range), lin(NULL) {}
+    ~Leaf() { delete lin; }
+
+    AType find(const KType &key) const { return range.find(key); }
+    std::set<AType> findAll() const { return range.findAll(); }
+    Range<KType,AType> materialize() const { return range; }
+    bool evaluated() const { return true; }
+    const Linearization<KType,AType>& flat() const {
+      if (!lin) {
+        lin = new Linearization<KType,AType>();
+        range.linearize(*lin);
+        lin->coalesce();
+      }
+      return *lin;
+    }
+
+  private:
+    const Range<KType,AType> range;
+    mutable Linearization<KType,AType> *lin;
+  };
+
+  template <class Merger>
+  class Merge : public Node
+  {
+  public:
+    Merge(Node *a, Node *b, const Merger &merger)
+      : Node(merger(a->dfl_action, b->dfl_action)), a(a), b(b), merger(merger), lin(NULL)
+    {
+      ++a->refs;
+      ++b->refs;
+    }
+    ~Merge() {
+      delete lin;
+      Node::release(a);
+      Node::release(b);
+    }
+
+    AType find(const KType &key) const {
+      if (lin)
+        return findFlat(key);
+      RANGE_COUNT(merger_calls);
+      return merger(a->find(key), b->find(key));
+    }
+    std::set<AType> findAll() const {
+      const Linearization<KType,AType> &segments = flat();
+      std::set<AType> to_ret(segments.actions.begin(), segments.actions.end());
+      to_ret.insert(this->dfl_action);
+      return to_ret;
+    }
+    Range<KType,AType> materialize() const {
+      Range<KType,AType> to_ret(this->dfl_action);
+      to_ret.rebuild(flat());
+      return to_ret;
+    }
+    bool evaluated() const { return lin != NULL; }
+    const Linearization<KType,AType>& flat() const {
+      if (!lin) {
+        // each pair of actions is merged once, however many segments
+        // it covers
+        MergeCache<AType> cache;
+        CountingMerger counting = { &merger };
+        CachedMerger<AType,std::less<AType>,CountingMerger> cached(&cache, &counting);
+        Linearization<KType,AType> *merged = new Linearization<KType,AType>();
+        SweepMerger<KType,AType>::merge(a->flat(), b->flat(), cached, *merged);
+        merged->coalesce();
+        lin = merged;
+      }
+      return *lin;
+    }
+
+  private:
+    Node *a;
+    Node *b;
+    mutable Merger merger;
+    // NULL until flat() is first called
+    mutable Linearization<KType,AType> *lin;
+
+    struct CountingMerger {
+      Merger *merger;
+      inline AType operator()(const AType &x, const AType &y) const {
+        RANGE_COUNT(merger_calls);
+        return (*merger)(x, y);
+      }
+    };
+
+    // the action of the segment holding 'key': the first one whose
+    // upper cut lies above it
+    AType findFlat(const KType &key) const {
+      size_t lo = 0, hi = lin->cuts.size();
+      while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (lin->cuts[mid].below(key))
+          hi = mid;
+        else
+          lo = mid + 1;
+      }
+      return lin->actions[lo];
+    }
+  };
+
+  Node *root;
+
+  explicit LazyRange(Node *root) : root(root) {}
+};
+
+#endif /* LAZY_HPP_INCLUDED */
@@ -0,0 +1,368 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPED_HPP_INCLUDED
+#define MAPPED_HPP_INCLUDED
+
+#include <limits>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "internals.hpp"
+
+/* Little-endian encoding of unsigned integers, one byte at a time, so
+ * that neither the byte order nor the alignment of the host matter */
+struct LittleEndian
+{
+  static void put(std::string &out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i)
+      out += (char)(unsigned char)(value >> (8 * i));
+  }
+  static uint64_t get(const unsigned char *p, size_t bytes) {
+    uint64_t to_ret = 0;
+    for (size_t i = 0; i < bytes; ++i)
+      to_ret |= (uint64_t)p[i] << (8 * i);
+    return to_ret;
+  }
+};
+
+/* How the actions of a Range are written to, and read back from, its
+ * serialized form. encode() appends the bytes of 'action' to 'out';
+ * decode() gets back exactly those bytes. Integral types, float, double
+ * and std::string are provided; any other AType has to specialize it. */
+template <class AType, bool integral = std::numeric_limits<AType>::is_integer>
+struct ActionCodec;
+
+template <class AType>
+struct ActionCodec<AType, true>
+{
+  static void encode(const AType &action, std::string &out) {
+    LittleEndian::put(out, (uint64_t)action, sizeof(AType));
+  }
+  static AType decode(const unsigned char *p, size_t n) {
+    return (AType)LittleEndian::get(p, sizeof(AType));
+  }
+};
+
+template <>
+struct ActionCodec<float, false>
+{
+  static void encode(const float &action, std::string &out) {
+    uint32_t bits;
+    memcpy(&bits, &action, sizeof(bits));
+    LittleEndian::put(out, bits, sizeof(bits));
+  }
+  static float decode(const unsigned char *p, size_t n) {
+    const uint32_t bits = (uint32_t)LittleEndian::get(p, sizeof(bits));
+    float to_ret;
+    memcpy(&to_ret, &bits, sizeof(to_ret));
+    return to_ret;
+  }
+};
+
+template <>
+struct ActionCodec<double, false>
+{
+  static void encode(const double &action, std::string &out) {
+    uint64_t bits;
+    memcpy(&bits, &action, sizeof(bits));
+    LittleEndian::put(out, bits, sizeof(bits));
+  }
+  static double decode(const unsigned char *p, size_t n) {
+    const uint64_t bits = LittleEndian::get(p, sizeof(bits));
+    double to_ret;
+    memcpy(&to_ret, &bits, sizeof(to_ret));
+    return to_ret;
+  }
+};
+
+template <>
+struct ActionCodec<std::string, false>
+{
+  static void encode(const std::string &action, std::string &out) { out += action; }
+  static std::string decode(const unsigned char *p, size_t n) {
+    return std::string((const char*)p, n);
+  }
+};
+
+/* A Range with integral keys, read in place from its serialized form:
+ * typically a file mapped in memory with open(), so that loading it
+ * costs nothing and all the processes mapping the same file share its
+ * pages. Lookups run a binary search over the mapped cuts and allocate
+ * nothing, except what decoding the action itself needs. Attaching only
+ * checks the header and the sizes of the sections; a corrupted action
+ * table is detected, and aborts, when a lookup reaches it.
+ *
+ * The format, version 1, is made of little-endian fields:
+ *   header   "LRNG", version (u32), key size (u32), signed keys (u32),
+ *            cuts (u64), actions (u64), action bytes (u64)
+ *   keys     one per cut, 'key size' bytes each
+ *   incl     one byte per cut, 1 when the key of the cut lies below it
+ *   ids      one u32 per segment (cuts + 1), indexing the actions
+ *   offsets  actions + 1 u64, where each action starts in the blob
+ *   blob     the encoded actions, each one appearing only once
+ * Adjacent segments with the same action are merged when writing.
+ */
+template <class KType, class AType>
+class MappedRange
+{
+public:
+  static const uint32_t version = 1;
+
+  MappedRange() : base(NULL), length(0), mapped(false) { reset(); }
+  ~MappedRange() { close(); }
+
+  // writes 'lin', which must span the whole key space
+  static void write(const Linearization<KType,AType> &lin, std::ostream &out);
+
+  // reads the Range out of 'size' bytes at 'data', which must stay
+  // valid and unchanged while in use; returns false if they are malformed
+  bool attach(const void *data, size_t size);
+  // maps the file at 'path' and attaches to it; returns false if it
+  // cannot be mapped or is malformed
+  bool open(const char *path);
+  // detaches, unmapping the file if open() mapped it
+  void close();
+  bool valid() const { return base != NULL; }
+
+  size_t segments() const { return (size_t)n_cuts + 1; }
+  size_t actionCount() const { return (size_t)n_actions; }
+
+  // the index of the action of 'key', for action()
+  inline uint32_t findId(const KType &key) const;
+  AType action(uint32_t id) const;
+  AType find(const KType &key) const { return action(findId(key)); }
+
+private:
+  enum { header_bytes = 40 };
+
+  const unsigned char *base;
+  size_t length;
+  bool mapped;
+  uint64_t n_cuts;
+  uint64_t n_actions;
+  uint64_t n_blob;
+  const unsigned char *keys;
+  const unsigned char *incl;
+  const unsigned char *ids;
+  const unsigned char *offsets;
+  const unsigned char *blob;
+
+  void reset();
+  inline KType keyAt(uint64_t i) const {
+    const uint64_t raw = LittleEndian::get(keys + i * sizeof(KType), sizeof(KType));
+    return (KType)raw;
+  }
+
+  static size_t padding(size_t at, size_t alignment) {
+    return (alignment - at % alignment) % alignment;
+  }
+
+  // a MappedRange may own a mapping, so it is not copyable
+  MappedRange(const MappedRange&);
+  MappedRange& operator=(const MappedRange&);
+};
+
+
+/* == template implementation follows == */
+template <class KType, class AType>
+void MappedRange<KType,AType>::write(const Linearization<KType,AType> &lin, std::ostream &out)
+{
+  if (!std::numeric_limits<KType>::is_integer || sizeof(KType) > sizeof(uint64_t))
+    abort(); // only integral keys can be mapped
+  Linearization<KType,AType> compact(lin);
+  compact.coalesce();
+  if (compact.actions.size() != compact.cuts.size() + 1)
+    abort(); // only a whole key space can be written
+
+  // intern the actions, in order of appearance
+  std::map<AType,uint32_t> known;
+  std::vector<uint32_t> segment_ids;
+  std::string blob;
+  std::vector<uint64_t> starts;
+  for (size_t i = 0; i < compact.actions.size(); ++i) {
+    typename std::map<AType,uint32_t>::iterator k = known.find(compact.actions[i]);
+    if (k == known.end()) {
+      k = known.insert(std::make_pair(compact.actions[i], (uint32_t)starts.size())).first;
+      starts.push_back(blob.size());
+      ActionCodec<AType>::encode(compact.actions[i], blob);
+    }
+    segment_ids.push_back(k->second);
+  }
+  starts.push_back(blob.size());
+
+  std::string data("LRNG");
+  LittleEndian::put(data, version, 4);
+  LittleEndian::put(data, sizeof(KType), 4);
+  LittleEndian::put(data, std::numeric_limits<KType>::is_signed, 4);
+  LittleEndian::put(data, compact.cuts.size(), 8);
+  LittleEndian::put(data, starts.size() - 1, 8);
+  LittleEndian::put(data, blob.size(), 8);
+  for (size_t i = 0; i < compact.cuts.size(); ++i)
+    LittleEndian::put(data, (uint64_t)compact.cuts[i].key, sizeof(KType));
+  for (size_t i = 0; i < compact.cuts.size(); ++i)
+    data += (char)compact.cuts[i].incl;
+  data.append(padding(data.size(), 4), '\0');
+  for (size_t i = 0; i < segment_ids.size(); ++i)
+    LittleEndian::put(data, segment_ids[i], 4);
+  data.append(padding(data.size(), 8), '\0');
+  for (size_t i = 0; i < starts.size(); ++i)
+    LittleEndian::put(data, starts[i], 8);
+  data += blob;
+  out.write(data.data(), data.size());
+}
+
+template <class KType, class AType>
+void MappedRange<KType,AType>::reset()
+{
+  base = NULL;
+  length = 0;
+  mapped = false;
+  n_cuts = n_actions = n_blob = 0;
+  keys = incl = ids = offsets = blob = NULL;
+}
+
+template <class KType, class AType>
+bool MappedRange<KType,AType>::attach(const void *data, size_t size)
+{
+  close();
+  const unsigned char *p = (const unsigned char*)data;
+  if (size < header_bytes || memcmp(p, "LRNG", 4)
+      || LittleEndian::get(p + 4, 4) != version
+      || LittleEndian::get(p + 8, 4) != sizeof(KType)
+      || LittleEndian::get(p + 12, 4) != (uint64_t)std::numeric_limits<KType>::is_signed)
+    return false;
+  const uint64_t cuts = LittleEndian::get(p + 16, 8);
+  const uint64_t actions = LittleEndian::get(p + 24, 8);
+  const uint64_t blob_bytes = LittleEndian::get(p + 32, 8);
+  // checked one section at a time, so that nothing can overflow
+  uint64_t at = header_bytes;
+  if (cuts > (size - at) / (sizeof(KType) + 1 + 4))
+    return false;
+  const uint64_t keys_at = at;
+  at += cuts * sizeof(KType);
+  const uint64_t incl_at = at;
+  at += cuts;
+  at += padding(at, 4);
+  const uint64_t ids_at = at;
+  at += (cuts + 1) * 4;
+  at += padding(at, 8);
+  if (at > size || actions >= (size - at) / 8)
+    return false;
+  const uint64_t offsets_at = at;
+  at += (actions + 1) * 8;
+  if (blob_bytes != size - at)
+    return false;
+  const uint64_t blob_at = at;
+  // the ids and the offsets are only checked by action(), so that
+  // attaching reads nothing but the header
+
+  base = p;
+  length = size;
+  n_cuts = cuts;
+  n_actions = actions;
+  n_blob = blob_bytes;
+  keys = p + keys_at;
+  incl = p + incl_at;
+  ids = p + ids_at;
+  offsets = p + offsets_at;
+  blob = p + blob_at;
+  return true;
+}
+
+template <class KType, class AType>
+bool MappedRange<KType,AType>::open(const char *path)
+{
+  close();
+#ifdef WIN32
+  return false;
+#else
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+  const size_t size = (size_t)st.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping outlives the descriptor
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  if (!attach(data, size)) {
+    munmap(data, size);
+    return false;
+  }
+  mapped = true;
+  return true;
+#endif
+}
+
+template <class KType, class AType>
+void MappedRange<KType,AType>::close()
+{
+#ifndef WIN32
+  if (mapped)
+    munmap((void*)base, length);
+#endif
+  reset();
+}
+
+template <class KType, class AType>
+inline uint32_t MappedRange<KType,AType>::findId(const KType &key) const
+{
+  if (!base)
+    abort(); // nothing is attached
+  uint64_t lo = 0, hi = n_cuts;
+  while (lo < hi) {
+    const uint64_t mid = lo + (hi - lo) / 2;
+    const KType cut = keyAt(mid);
+    if (key < cut || (incl[mid] && key == cut))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return (uint32_t)LittleEndian::get(ids + 4 * lo, 4);
+}
+
+template <class KType, class AType>
+AType MappedRange<KType,AType>::action(uint32_t id) const
+{
+  if (!base || id >= n_actions)
+    abort(); // not an id of this Range, or a corrupted one
+  const uint64_t start = LittleEndian::get(offsets + 8 * (uint64_t)id, 8);
+  const uint64_t end = LittleEndian::get(offsets + 8 * ((uint64_t)id + 1), 8);
+  if (start > end || end > n_blob)
+    abort(); // a corrupted action table
+  return ActionCodec<AType>::decode(blob + start, (size_t)(end - start));
+}
+
+#endif /* MAPPED_HPP_INCLUDED */
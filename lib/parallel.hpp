@@ -0,0 +1,176 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARALLEL_HPP_INCLUDED
+#define PARALLEL_HPP_INCLUDED
+
+class WorkPool; // fwd decl, so that pointers to it exist in any case
+
+#if __cplusplus >= 201103L
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A small work-stealing pool. Each worker owns a deque of tasks: it
+ * pushes and pops at the back, while the others steal from the front.
+ * Worker 0 is whichever thread outside the pool submits the first
+ * tasks; it runs tasks as well while waiting for them to complete.
+ * Since tasks can wait for the tasks they submit, they can fork and
+ * join recursively.
+ */
+class WorkPool
+{
+public:
+  explicit WorkPool(size_t threads)
+    : stopping(false), pending(0)
+  {
+    for (size_t i = 0; i <= threads; ++i)
+      queues.push_back(std::unique_ptr<Queue>(new Queue()));
+    for (size_t i = 1; i <= threads; ++i)
+      workers.push_back(std::thread(&WorkPool::work, this, i));
+  }
+
+  ~WorkPool() {
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      stopping = true;
+    }
+    idle.notify_all();
+    for (size_t i = 0; i < workers.size(); ++i)
+      workers[i].join();
+  }
+
+  // the number of workers, including worker 0
+  size_t size() const { return queues.size(); }
+
+  // the index of the calling thread; 0 for any thread outside the pool
+  static size_t currentWorker() { return index(); }
+
+  void submit(std::function<void()> task) {
+    Queue &q = *queues[currentWorker()];
+    {
+      std::lock_guard<std::mutex> guard(q.lock);
+      q.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      ++pending;
+    }
+    idle.notify_one();
+  }
+
+  // runs one task, from our own queue if possible; false if none was found
+  bool runOne() {
+    const size_t self = currentWorker();
+    std::function<void()> task;
+    if (!take(self, true, task)) {
+      for (size_t i = 1; i < queues.size(); ++i)
+        if (take((self + i) % queues.size(), false, task))
+          break;
+      if (!task)
+        return false;
+    }
+    --pending;
+    task();
+    return true;
+  }
+
+  // serializes the users of the pool, since worker 0 is shared
+  std::mutex session;
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::function<void()> > tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue> > queues;
+  std::vector<std::thread> workers;
+  bool stopping;
+  std::atomic<size_t> pending;
+  std::mutex idle_lock;
+  std::condition_variable idle;
+
+  static size_t& index() {
+    static thread_local size_t i = 0;
+    return i;
+  }
+
+  bool take(size_t from, bool own, std::function<void()> &task) {
+    Queue &q = *queues[from];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tasks.empty())
+      return false;
+    if (own) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+    } else {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+    }
+    return true;
+  }
+
+  void work(size_t self) {
+    index() = self;
+    for (;;) {
+      if (runOne())
+        continue;
+      std::unique_lock<std::mutex> guard(idle_lock);
+      idle.wait(guard, [this] { return stopping || pending > 0; });
+      if (stopping)
+        return;
+    }
+  }
+};
+
+/* A set of tasks that can be waited for together */
+class TaskGroup
+{
+public:
+  explicit TaskGroup(WorkPool &pool) : pool(pool), left(0) {}
+  ~TaskGroup() { wait(); }
+
+  void run(std::function<void()> task) {
+    ++left;
+    pool.submit([this, task] { task(); --left; });
+  }
+
+  // helps running tasks until all the ones of this group are done
+  void wait() {
+    while (left > 0)
+      if (!pool.runOne())
+        std::this_thread::yield();
+  }
+
+private:
+  WorkPool &pool;
+  std::atomic<size_t> left;
+};
+
+#endif /* __cplusplus >= 201103L */
+
+#endif /* PARALLEL_HPP_INCLUDED */
@@ -0,0 +1,112 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILE_HPP_INCLUDED
+#define PROFILE_HPP_INCLUDED
+
+#include <istream>
+#include <map>
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+#include "internals.hpp"
+
+/* The keys looked up in a Range, with how many times each one was seen.
+ * Once attached to a Range, it samples one find() out of 'period'.
+ * Keys are stored rather than segments, so that a profile still applies
+ * after the Range changes, and can be saved and loaded across runs.
+ */
+template <class KType>
+class RangeProfile
+{
+public:
+  explicit RangeProfile(unsigned period = 1)
+    : period(period ? period : 1), countdown(this->period), total(0) {}
+
+  inline void record(const KType &key) {
+    if (--countdown)
+      return;
+    countdown = period;
+    add(key, 1);
+  }
+  void add(const KType &key, uint64_t n) {
+    counts[key] += n;
+    total += n;
+  }
+  void clear() {
+    counts.clear();
+    total = 0;
+    countdown = period;
+  }
+
+  uint64_t samples() const { return total; }
+  const std::map<KType,uint64_t>& hits() const { return counts; }
+
+  // the samples that fall into each segment of 'lin'
+  template <class AType>
+  std::vector<uint64_t> segmentHits(const Linearization<KType,AType> &lin) const;
+
+  // one "key hits" line per key; load() adds to what is there already,
+  // and returns false if the input is malformed
+  void save(std::ostream &out) const;
+  bool load(std::istream &in);
+
+private:
+  std::map<KType,uint64_t> counts;
+  unsigned period;
+  unsigned countdown;
+  uint64_t total;
+};
+
+
+/* == template implementation follows == */
+template <class KType>
+template <class AType>
+std::vector<uint64_t> RangeProfile<KType>::segmentHits(const Linearization<KType,AType> &lin) const
+{
+  std::vector<uint64_t> to_ret(lin.actions.size(), 0);
+  // both the keys and the segments are sorted
+  size_t segment = 0;
+  for (typename std::map<KType,uint64_t>::const_iterator i = counts.begin(); i != counts.end(); ++i) {
+    while (segment < lin.cuts.size() && !lin.cuts[segment].below(i->first))
+      ++segment;
+    to_ret[segment] += i->second;
+  }
+  return to_ret;
+}
+
+template <class KType>
+void RangeProfile<KType>::save(std::ostream &out) const
+{
+  for (typename std::map<KType,uint64_t>::const_iterator i = counts.begin(); i != counts.end(); ++i)
+    out << i->first << " " << i->second << std::endl;
+}
+
+template <class KType>
+bool RangeProfile<KType>::load(std::istream &in)
+{
+  KType key;
+  uint64_t n;
+  while (in >> key >> n)
+    add(key, n);
+  return in.eof();
+}
+
+#endif /* PROFILE_HPP_INCLUDED */
@@ -21,16 +21,39 @@
 #ifndef RANGE_HPP_INCLUDED
 #define RANGE_HPP_INCLUDED
 
+#include <algorithm>
+#include <functional>
+#include <limits>
 #include <map>
+#include <queue>
 #include <set>
 #include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#include <utility>
+#endif
 #include "common.h"
+#include "cache.hpp"
 #include "internals.hpp"
+#include "frozen.hpp"
+#include "codegen.hpp"
+#include "profile.hpp"
+#include "direct.hpp"
+#include "mapped.hpp"
+#include "segments.hpp"
+#include "lazy.hpp"
 
 /* == important declarations == */
 
 /* KType specifies the type of the data associated with the range keys,
  * AType specifies the type of the action to which each range is associated
+ *
+ * Copies share their nodes until they are changed, and the counts that
+ * track the sharing are not atomic: a Range and the copies made from it,
+ * directly or not, must be copied, changed and destroyed by one thread at
+ * a time. Lookups and intersections only read their Ranges, and can run
+ * on several threads at once, unless a profile is attached.
  */
 template <class KType, class AType>
 class Range
@@ -44,13 +67,115 @@ public:
   Range(AType dfl_action);
   Range(const Range &other);
   Range(const Range *other);
+  ~Range();
+  Range& operator=(const Range &other);
+#if __cplusplus >= 201103L
+  // a moved-from Range is left empty and usable; moving allocates
+  // nothing, so it cannot throw unless moving an AType can
+  Range(Range &&other) noexcept(std::is_nothrow_move_constructible<AType>::value);
+  Range& operator=(Range &&other) noexcept(std::is_nothrow_move_constructible<AType>::value &&
+                                           std::is_nothrow_move_assignable<AType>::value);
+#endif
+  void swap(Range &other);
   void addRange(RangeOperator_t op, KType key, AType action);
   AType find(KType key) const;
   std::set<AType> findAll() const;
-  static Range intersect(Range a, Range b, merger_func_t merger, void *extra_info);
+  static Range intersect(const Range &a, const Range &b, merger_func_t merger, void *extra_info);
   static Range* intersect(Range *a, Range *b, merger_func_t merger, void *extra_info);
+  void intersectWith(const Range &other, merger_func_t merger, void *extra_info);
+  // the same, with any callable taking two const AType& and returning the
+  // merged AType, such as a lambda or a functor; it is copied, as by the
+  // algorithms of the STL, and can be inlined into the merge
+  template <class Merger>
+  static Range intersect(const Range &a, const Range &b, Merger merger);
+  template <class Merger>
+  void intersectWith(const Range &other, Merger merger);
+  template <class Compare>
+  static Range intersect(const Range &a, const Range &b, merger_func_t merger, void *extra_info, MergeCache<AType,Compare> &cache);
+  template <class Compare>
+  void intersectWith(const Range &other, merger_func_t merger, void *extra_info, MergeCache<AType,Compare> &cache);
+  static Range intersectSweep(const Range &a, const Range &b, merger_func_t merger, void *extra_info);
+  // the intersection of 'a' and 'b', computed only as far as it is
+  // queried; either can be a Range or another lazy intersection
+  static LazyRange<KType,AType> lazyIntersect(const LazyRange<KType,AType> &a, const LazyRange<KType,AType> &b, merger_func_t merger, void *extra_info);
+  template <class Merger>
+  static LazyRange<KType,AType> lazyIntersect(const LazyRange<KType,AType> &a, const LazyRange<KType,AType> &b, Merger merger);
+  template <class Iterator>
+  static Range intersectAll(Iterator first, Iterator last, merger_func_t merger, void *extra_info, bool reorderable = false);
+#if __cplusplus >= 201103L
+  static Range intersectParallel(const Range &a, const Range &b, merger_func_t merger, void *extra_info, WorkPool &pool);
+#endif
   void traverse(range_callback_func_t range_callback, punt_callback_func_t punt_callback, action_callback_func_t action_callback, void *extra_info) const;
+  // the same, with any callables: range_callback(op, const KType&),
+  // punt_callback(op, const std::map<KType,AType>&), action_callback(const AType&)
+  template <class RangeCallback, class PuntCallback, class ActionCallback>
+  void traverse(RangeCallback range_callback, PuntCallback punt_callback, ActionCallback action_callback) const;
+  // the segments of the Range in key order, walked lazily; they are
+  // invalidated by any change to the Range
+  Segments<KType,AType> segments() const { return Segments<KType,AType>(tree, default_action); }
   void changeActions(const std::map<AType,AType> &mappings);
+  // replaces each action with what 'mapper', any callable taking a
+  // const AType&, returns for it
+  template <class Mapper>
+  void changeActions(Mapper mapper);
+  FrozenRange<KType,AType> freeze() const;
+  DecisionProgram<KType,AType> compile(const CodegenCosts &costs = CodegenCosts()) const;
+  // writes the binary form read by MappedRange; the keys must be integral
+  void save(std::ostream &out) const;
+  TreeShape shape() const;
+  // what the Range is made of, and about how much memory it takes
+  struct Stats {
+    size_t action_nodes;
+    size_t range_nodes;
+    size_t punct_nodes;
+    size_t punct_entries;
+    size_t max_depth;
+    double avg_depth;
+    size_t bytes;
+  };
+  Stats stats() const;
+  // the outcome of a rebalance()
+  struct Balance {
+    size_t depth_before;
+    size_t depth_after;
+    size_t segments;
+  };
+  Balance rebalance();
+  // the outcome of a minimize()
+  struct Minimization {
+    size_t nodes_before;
+    size_t nodes_after;
+    size_t segments;
+  };
+  Minimization minimize();
+  // samples the keys of find() into 'profile', until it
+  // is detached with NULL; copies of this Range are not profiled
+  void setProfile(RangeProfile<KType> *profile) { profiler = profile; }
+  double expectedComparisons(const RangeProfile<KType> &profile) const;
+  // the outcome of a reoptimize(): the average number of key comparisons
+  // made by the lookups in the profile
+  struct Reoptimization {
+    double compares_before;
+    double compares_after;
+    size_t segments;
+  };
+  Reoptimization reoptimize(const RangeProfile<KType> &profile);
+  // keeps a table with the action of each key in [lo, hi], so that
+  // looking any of them up is a single load; the table costs 4 bytes per
+  // key, is copied with the Range, and addRange() updates it in place
+  void setDirectIndex(KType lo, KType hi);
+  // the same, over all the keys of a type of at most 16 bits
+  void setDirectIndex();
+  void clearDirectIndex();
+  bool hasDirectIndex() const { return direct != NULL; }
+  // intersections into this Range, or with it as their first input,
+  // rebalance their result when its depth exceeds 'factor' times log2 of
+  // its segments; the check walks the result, so it is off (0) unless
+  // set, and the factor is copied with the Range
+  void setRebalanceFactor(double factor) { rebalance_factor = factor; }
+  // the same intersections minimize() their result first when this is
+  // set; off unless set, and copied with the Range
+  void setMinimizeIntersections(bool minimize) { minimize_intersections = minimize; }
 
   /* ** helper methods ** */
   static std::string rangeOp2str(RangeOperator_t op) {
@@ -81,51 +206,172 @@ public:
   }
 
 private:
+  template <class K, class A> friend class RangeBuilder;
+  template <class K, class A> friend class LazyRange;
+  template <class K, class A, class M> friend class IntersectionView;
+
   AType default_action;
   OpNode<KType,AType> *tree;
+  // the size of 'tree' as TreeOverlay counts it, kept up to date by
+  // addRange(); 0 when it must be counted again, after other changes
+  size_t tree_size;
+  // owns all the nodes of 'tree'; NULL in a moved-from Range, until
+  // ownArena() is called for a change
+  NodeArena<KType,AType> *arena;
+  RangeProfile<KType> *profiler;
+  // owned; NULL unless setDirectIndex() was called
+  DirectIndex<KType,AType> *direct;
+  double rebalance_factor;
+  bool minimize_intersections;
+
+  void linearize(Linearization<KType,AType> &out) const;
+  void rebuild(const Linearization<KType,AType> &lin, const std::vector<double> *weights = NULL);
+  void finishIntersection(const Range &first);
+  void refillDirectIndex();
+  NodeArena<KType,AType>* ownArena();
+  size_t treeSize();
+  size_t rebuildCanonical();
+  template <class Merger>
+  static OpNode<KType,AType>* mergeTrees(const Range &a, const Range &b, const MergeContext<KType,AType,Merger> &ctx);
+  template <class Change>
+  void changeActionsWith(Change &change);
 };
 
 
 /* == template implementation follows == */
 template <class KType, class AType>
 Range<KType,AType>::Range(AType dfl_action)
-  : default_action(dfl_action), tree(NULL)
+  : default_action(dfl_action), tree(NULL), tree_size(0), arena(new NodeArena<KType,AType>()), profiler(NULL),
+    direct(NULL), rebalance_factor(0), minimize_intersections(false)
 {
 }
 
+/* copies share the arena and the whole tree of 'other'; nodes are
+ * copied later, and only along the paths that get modified */
 template <class KType, class AType>
 Range<KType,AType>::Range(const Range<KType,AType> &other)
-  : default_action(other.default_action)
+  : default_action(other.default_action), tree_size(other.tree_size), arena(other.arena), profiler(NULL),
+    direct(other.direct ? new DirectIndex<KType,AType>(*other.direct) : NULL),
+    rebalance_factor(other.rebalance_factor), minimize_intersections(other.minimize_intersections)
 {
+  if (arena)
+    arena->join();
   if (other.tree)
-    this->tree = other.tree->clone();
+    this->tree = static_cast<OpNode<KType,AType>*>(arena->share(other.tree));
   else
     this->tree = NULL;
 }
 
 template <class KType, class AType>
 Range<KType,AType>::Range(const Range<KType,AType> *other)
-  : default_action(other->default_action)
+  : default_action(other->default_action), tree_size(other->tree_size), arena(other->arena), profiler(NULL),
+    direct(other->direct ? new DirectIndex<KType,AType>(*other->direct) : NULL),
+    rebalance_factor(other->rebalance_factor), minimize_intersections(other->minimize_intersections)
 {
+  if (arena)
+    arena->join();
   if (other->tree)
-    this->tree = other->tree->clone();
+    this->tree = static_cast<OpNode<KType,AType>*>(arena->share(other->tree));
   else
     this->tree = NULL;
 }
 
+/* all the nodes go away together with the arena, unless other Ranges
+ * still use it */
+template <class KType, class AType>
+Range<KType,AType>::~Range()
+{
+  delete direct;
+  if (!arena)
+    return; // moved from, and not changed since
+  if (arena->leave())
+    delete arena;
+  else if (tree)
+    arena->releaseTree(tree);
+}
+
+template <class KType, class AType>
+Range<KType,AType>& Range<KType,AType>::operator=(const Range<KType,AType> &other)
+{
+  Range<KType,AType> tmp(other);
+  swap(tmp);
+  return *this;
+}
+
+#if __cplusplus >= 201103L
+template <class KType, class AType>
+Range<KType,AType>::Range(Range<KType,AType> &&other)
+  noexcept(std::is_nothrow_move_constructible<AType>::value)
+  : default_action(std::move(other.default_action)), tree(other.tree), tree_size(other.tree_size),
+    arena(other.arena), profiler(NULL), direct(other.direct), rebalance_factor(other.rebalance_factor),
+    minimize_intersections(other.minimize_intersections)
+{
+  other.direct = NULL;
+  other.tree = NULL;
+  other.tree_size = 0;
+  other.arena = NULL;
+}
+
+template <class KType, class AType>
+Range<KType,AType>& Range<KType,AType>::operator=(Range<KType,AType> &&other)
+  noexcept(std::is_nothrow_move_constructible<AType>::value &&
+           std::is_nothrow_move_assignable<AType>::value)
+{
+  // our old nodes go away together with 'other'
+  swap(other);
+  return *this;
+}
+#endif
+
+template <class KType, class AType>
+void Range<KType,AType>::swap(Range<KType,AType> &other)
+{
+  std::swap(default_action, other.default_action);
+  std::swap(tree, other.tree);
+  std::swap(tree_size, other.tree_size);
+  std::swap(arena, other.arena);
+  std::swap(direct, other.direct);
+  std::swap(rebalance_factor, other.rebalance_factor);
+  std::swap(minimize_intersections, other.minimize_intersections);
+  // profiles stay with the objects they were attached to
+}
+
+/* maps all the keys satisfying 'op' against 'key' to 'action', on top
+ * of what was added before; any number of ranges can be added */
 template <class KType, class AType>
 void Range<KType,AType>::addRange
 (RangeOperator_t op, KType key, AType action)
 {
-  if (tree == NULL)
-    tree = OpNode<KType,AType>::buildOpNode(default_action, op, key, action);
+  TreeNode<KType,AType> *root = tree;
+  NodeArena<KType,AType> *arena = ownArena();
+  size_t size = 1;
+  if (root)
+    size = treeSize();
   else
-    tree->addRange(op, key, action);
+    root = arena->newAction(default_action);
+  root = TreeOverlay<KType,AType>::apply(root, op, key, action, arena, size);
+  if (direct)
+    direct->paint(op, key, action);
+  if (root->getType() == ACTION) {
+    // everything was painted with a single action
+    default_action = static_cast<ActionNode<KType,AType>*>(root)->getAction();
+    arena->releaseTree(root);
+    tree = NULL;
+    tree_size = 0;
+  } else {
+    tree = static_cast<OpNode<KType,AType>*>(root);
+    tree_size = size;
+  }
 }
 
 /* returns the action associated with the provided key */
 template <class KType, class AType>
 AType Range<KType,AType>::find(KType key) const{
+  RANGE_COUNT(lookups);
+  if (profiler)
+    profiler->record(key);
+  if (direct && direct->covers(key))
+    return direct->find(key);
   if (tree == NULL)
     return default_action;
 
@@ -145,63 +391,250 @@ std::set<AType> Range<KType,AType>::findAll() const{
 }
 
 template <class KType, class AType>
-Range<KType,AType> Range<KType,AType>::intersect(Range a, Range b, merger_func_t merger, void* extra_info)
+Range<KType,AType> Range<KType,AType>::intersect(const Range &a, const Range &b, merger_func_t merger, void* extra_info)
+{
+  return intersect(a, b, FunctionMerger<AType>(merger, extra_info));
+}
+
+template <class KType, class AType>
+Range<KType,AType>* Range<KType,AType>::intersect(Range *a, Range *b, merger_func_t merger, void* extra_info)
+{
+  FunctionMerger<AType> call(merger, extra_info);
+  Range *result = new Range(call(a->default_action, b->default_action));
+
+  result->tree = mergeTrees(*a, *b, MergeContext<KType,AType>(&call, result->arena));
+  result->finishIntersection(*a);
+  return result;
+}
+
+template <class KType, class AType>
+void Range<KType,AType>::intersectWith(const Range &other, merger_func_t merger, void* extra_info)
+{
+  intersectWith(other, FunctionMerger<AType>(merger, extra_info));
+}
+
+template <class KType, class AType>
+template <class Merger>
+Range<KType,AType> Range<KType,AType>::intersect(const Range &a, const Range &b, Merger merger)
+{
+  Range result(merger(a.default_action, b.default_action));
+
+  result.tree = mergeTrees(a, b, MergeContext<KType,AType,Merger>(&merger, result.arena));
+  result.finishIntersection(a);
+  return result;
+}
+
+/* same as *this = intersect(*this, other, ...), but the new tree is
+ * built in the arena of this Range, reusing the nodes of the old one */
+template <class KType, class AType>
+template <class Merger>
+void Range<KType,AType>::intersectWith(const Range &other, Merger merger)
+{
+  AType new_dfl = merger(default_action, other.default_action);
+  OpNode<KType,AType> *new_tree = mergeTrees(*this, other, MergeContext<KType,AType,Merger>(&merger, ownArena()));
+
+  // the old tree is read by the merge, so it can only be dropped now
+  if (tree)
+    arena->releaseTree(tree);
+  tree = new_tree;
+  tree_size = 0;
+  std::swap(default_action, new_dfl);
+  finishIntersection(*this);
+  refillDirectIndex();
+}
+
+/* Same as intersect(), but the merger is only called for the pairs of
+ * actions that 'cache' does not know yet */
+template <class KType, class AType>
+template <class Compare>
+Range<KType,AType> Range<KType,AType>::intersect(const Range &a, const Range &b, merger_func_t merger, void* extra_info, MergeCache<AType,Compare> &cache)
+{
+  FunctionMerger<AType> call(merger, extra_info);
+  return intersect(a, b, CachedMerger<AType,Compare,FunctionMerger<AType> >(&cache, &call));
+}
+
+/* same as intersectWith(), going through 'cache' as intersect() does */
+template <class KType, class AType>
+template <class Compare>
+void Range<KType,AType>::intersectWith(const Range &other, merger_func_t merger, void* extra_info, MergeCache<AType,Compare> &cache)
+{
+  FunctionMerger<AType> call(merger, extra_info);
+  intersectWith(other, CachedMerger<AType,Compare,FunctionMerger<AType> >(&cache, &call));
+}
+
+/* Same as intersect(), but computed over the flattened forms of 'a' and
+ * 'b' in O(n+m): the merger is invoked once per output segment (plus
+ * once for the default actions), and the result is a balanced tree.
+ * Unlike intersect(), the merger always gets the action of 'a' first.
+ */
+template <class KType, class AType>
+Range<KType,AType> Range<KType,AType>::intersectSweep(const Range &a, const Range &b, merger_func_t merger, void* extra_info)
 {
   AType new_dfl = (*merger)(a.default_action, b.default_action, extra_info);
   Range result(new_dfl);
 
-  result.tree = NULL;
-  if(a.tree != NULL && b.tree != NULL) {
-    TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(a.tree, b.tree, merger, extra_info, NULL, false, NULL, false);
-    // the following cast is legal, because by construction only an OpNode can be the root of the tree
-    result.tree = dynamic_cast<OpNode<KType,AType>*>(tmp);
-    if(!result.tree) abort(); // something broke
-  } else {
-    // otherwise take the (possibly) not-NULL tree and merge it with the other default action
-    if(a.tree) {
-      ActionNode<KType,AType> *tmp_action=new ActionNode<KType,AType>(b.default_action);
-      TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(a.tree, tmp_action, merger, extra_info, NULL, false, NULL, false);
-      result.tree = dynamic_cast<OpNode<KType,AType>*>(tmp);
-      if(!result.tree) abort(); // something broke
-      delete tmp_action;
-    } else if (b.tree) {
-      ActionNode<KType,AType> *tmp_action=new ActionNode<KType,AType>(a.default_action);
-      TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(b.tree, tmp_action, merger, extra_info, NULL, false, NULL, false);
-      result.tree = dynamic_cast<OpNode<KType,AType>*>(tmp);
-      if(!result.tree) abort(); // something broke
-      delete tmp_action;
-    }
+  Linearization<KType,AType> lin_a, lin_b, merged;
+  a.linearize(lin_a);
+  lin_a.coalesce();
+  b.linearize(lin_b);
+  lin_b.coalesce();
+  SweepMerger<KType,AType>::merge(lin_a, lin_b, merger, extra_info, merged);
+  merged.coalesce();
+
+  result.rebuild(merged);
+  return result;
+}
+
+template <class KType, class AType>
+LazyRange<KType,AType> Range<KType,AType>::lazyIntersect(const LazyRange<KType,AType> &a, const LazyRange<KType,AType> &b, merger_func_t merger, void* extra_info)
+{
+  return LazyRange<KType,AType>::intersect(a, b, FunctionMerger<AType>(merger, extra_info));
+}
+
+template <class KType, class AType>
+template <class Merger>
+LazyRange<KType,AType> Range<KType,AType>::lazyIntersect(const LazyRange<KType,AType> &a, const LazyRange<KType,AType> &b, Merger merger)
+{
+  return LazyRange<KType,AType>::intersect(a, b, merger);
+}
+
+/* Same as folding intersect() over the Ranges in [first, last), left to
+ * right, but no intermediate Range is built.
+ * By default all the inputs are swept at once, and each output segment
+ * costs at most one merger call per input whose action changes there.
+ * If the merger is associative and commutative, 'reorderable' lets the
+ * inputs be intersected pairwise instead, always picking the two with
+ * fewest segments: intermediate results stay small, and the number of
+ * merger calls drops from O(k^2) to O(k log k) per separator.
+ */
+template <class KType, class AType>
+template <class Iterator>
+Range<KType,AType> Range<KType,AType>::intersectAll(Iterator first, Iterator last, merger_func_t merger, void* extra_info, bool reorderable)
+{
+  if (first == last)
+    abort(); // nothing to intersect
+
+  std::vector<Linearization<KType,AType> > lins;
+  for (Iterator i = first; i != last; ++i) {
+    lins.push_back(Linearization<KType,AType>());
+    i->linearize(lins.back());
+    lins.back().coalesce();
   }
 
+  AType new_dfl = first->default_action;
+  std::vector<const Linearization<KType,AType>*> in;
+  Iterator i = first;
+  for (size_t n = 0; n < lins.size(); ++n, ++i) {
+    if (n > 0)
+      new_dfl = (*merger)(new_dfl, i->default_action, extra_info);
+    in.push_back(&lins[n]);
+  }
+  Range result(new_dfl);
+
+  if (!reorderable) {
+    Linearization<KType,AType> merged;
+    SweepMerger<KType,AType>::mergeAll(in, merger, extra_info, merged);
+    merged.coalesce();
+    result.rebuild(merged);
+    return result;
+  }
+
+  // smallest-first reduction: (segment count, index in 'lins')
+  std::priority_queue<std::pair<size_t, size_t>,
+                      std::vector<std::pair<size_t, size_t> >,
+                      std::greater<std::pair<size_t, size_t> > > sizes;
+  for (size_t n = 0; n < lins.size(); ++n)
+    sizes.push(std::make_pair(lins[n].actions.size(), n));
+  while (sizes.size() > 1) {
+    const size_t x = sizes.top().second;
+    sizes.pop();
+    const size_t y = sizes.top().second;
+    sizes.pop();
+
+    Linearization<KType,AType> merged;
+    SweepMerger<KType,AType>::merge(lins[x], lins[y], merger, extra_info, merged);
+    merged.coalesce();
+    // the operands are not needed anymore
+    Linearization<KType,AType>().cuts.swap(lins[x].cuts);
+    Linearization<KType,AType>().actions.swap(lins[x].actions);
+    lins[y].cuts.swap(merged.cuts);
+    lins[y].actions.swap(merged.actions);
+    sizes.push(std::make_pair(lins[y].actions.size(), y));
+  }
+
+  result.rebuild(lins[sizes.top().second]);
   return result;
 }
 
+#if __cplusplus >= 201103L
+/* Same as intersect(), but the independent sub-merges near the top of
+ * the trees are run as tasks of 'pool', each worker allocating from an
+ * arena of its own that the result takes over at the end. The merger is
+ * called from several threads at once, so it must be reentrant. The
+ * result is the same tree intersect() builds.
+ * Must not be called from a task running in 'pool'.
+ */
 template <class KType, class AType>
-Range<KType,AType>* Range<KType,AType>::intersect(Range *a, Range *b, merger_func_t merger, void* extra_info)
+Range<KType,AType> Range<KType,AType>::intersectParallel(const Range &a, const Range &b, merger_func_t merger, void* extra_info, WorkPool &pool)
 {
-  AType new_dfl = (*merger)(a->default_action, b->default_action, extra_info);
-  Range *result = new Range(new_dfl);
+  std::lock_guard<std::mutex> guard(pool.session);
+  AType new_dfl = (*merger)(a.default_action, b.default_action, extra_info);
+  Range result(new_dfl);
+
+  std::vector<NodeArena<KType,AType>*> arenas(pool.size());
+  arenas[0] = result.arena;
+  for (size_t i = 1; i < arenas.size(); ++i)
+    arenas[i] = new NodeArena<KType,AType>();
+
+  FunctionMerger<AType> call(merger, extra_info);
+  MergeContext<KType,AType> ctx(&call, result.arena);
+  ctx.pool = &pool;
+  ctx.arenas = &arenas[0];
+  // a few tasks per worker, so that stealing can even out the load
+  ctx.fork_depth = 2;
+  for (size_t n = pool.size(); n > 1; n >>= 1)
+    ++ctx.fork_depth;
 
-  result->tree = NULL;
-  if(a->tree != NULL && b->tree != NULL) {
-    TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(a->tree, b->tree, merger, extra_info, NULL, false, NULL, false);
+  result.tree = mergeTrees(a, b, ctx);
+
+  // the workers' nodes must belong to the result before any of them is
+  // released, as rebalancing does
+  for (size_t i = 1; i < arenas.size(); ++i) {
+    result.arena->adopt(*arenas[i]);
+    delete arenas[i];
+  }
+  result.finishIntersection(a);
+  return result;
+}
+#endif
+
+/* merges the trees of 'a' and 'b', allocating the result from the
+ * arena of 'ctx' */
+template <class KType, class AType>
+template <class Merger>
+OpNode<KType,AType>* Range<KType,AType>::mergeTrees(const Range &a, const Range &b, const MergeContext<KType,AType,Merger> &ctx)
+{
+  NodeArena<KType,AType> *arena = ctx.arena;
+  OpNode<KType,AType> *result = NULL;
+  if(a.tree != NULL && b.tree != NULL) {
+    TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(a.tree, b.tree, ctx, NULL, false, NULL, false);
     // the following cast is legal, because by construction only an OpNode can be the root of the tree
-    result->tree = dynamic_cast<OpNode<KType,AType>*>(tmp);
-    if(!result->tree) abort(); // something broke
+    if(tmp->getType() == ACTION) abort(); // something broke
+    result = static_cast<OpNode<KType,AType>*>(tmp);
   } else {
     // otherwise take the (possibly) not-NULL tree and merge it with the other default action
-    if(a->tree) {
-      ActionNode<KType,AType> *tmp_action=new ActionNode<KType,AType>(b->default_action);
-      TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(a->tree, tmp_action, merger, extra_info, NULL, false, NULL, false);
-      result->tree = dynamic_cast<OpNode<KType,AType>*>(tmp);
-      if(!result->tree) abort(); // something broke
-      delete tmp_action;
-    } else if (b->tree) {
-      ActionNode<KType,AType> *tmp_action=new ActionNode<KType,AType>(a->default_action);
-      TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(b->tree, tmp_action, merger, extra_info, NULL, false, NULL, false);
-      result->tree = dynamic_cast<OpNode<KType,AType>*>(tmp);
-      if(!result->tree) abort(); // something broke
-      delete tmp_action;
+    if(a.tree) {
+      ActionNode<KType,AType> *tmp_action = arena->newAction(b.default_action);
+      TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(a.tree, tmp_action, ctx, NULL, false, NULL, false);
+      if(tmp->getType() == ACTION) abort(); // something broke
+      result = static_cast<OpNode<KType,AType>*>(tmp);
+      arena->release(tmp_action);
+    } else if (b.tree) {
+      ActionNode<KType,AType> *tmp_action = arena->newAction(a.default_action);
+      TreeNode<KType,AType> *tmp = TreeMerger<KType,AType>::merge(b.tree, tmp_action, ctx, NULL, false, NULL, false);
+      if(tmp->getType() == ACTION) abort(); // something broke
+      result = static_cast<OpNode<KType,AType>*>(tmp);
+      arena->release(tmp_action);
     }
   }
 
@@ -215,33 +648,312 @@ void Range<KType,AType>::traverse
  action_callback_func_t action_callback,
  void* extra_info) const
 {
+  FunctionVisitor<KType,AType> visitor(range_callback, punt_callback, action_callback, extra_info);
+  if (tree)
+    tree->traverse(visitor);
+  else
+    visitor.action(default_action);
+}
+
+template <class KType, class AType>
+template <class RangeCallback, class PuntCallback, class ActionCallback>
+void Range<KType,AType>::traverse(RangeCallback range_callback, PuntCallback punt_callback, ActionCallback action_callback) const
+{
+  CallableVisitor<KType,AType,RangeCallback,PuntCallback,ActionCallback> visitor(&range_callback, &punt_callback, &action_callback);
   if (tree)
-    tree->traverse(range_callback, punt_callback, action_callback, extra_info);
-  else if (action_callback)
-    (*action_callback)(default_action, extra_info);
+    tree->traverse(visitor);
+  else
+    visitor.action(default_action);
 }
 
 template <class KType, class AType>
 void Range<KType,AType>::changeActions(const std::map<AType,AType> &mappings)
 {
-  typename std::map<AType,AType>::const_iterator i = mappings.find(default_action);
-  if(i != mappings.end())
-    default_action = i->second;
+  MapChange<AType> change(&mappings);
+  changeActionsWith(change);
+}
+
+template <class KType, class AType>
+template <class Mapper>
+void Range<KType,AType>::changeActions(Mapper mapper)
+{
+  MapperChange<AType,Mapper> change(&mapper);
+  changeActionsWith(change);
+}
+
+/* calls 'change' on every action, replacing it in place */
+template <class KType, class AType>
+template <class Change>
+void Range<KType,AType>::changeActionsWith(Change &change)
+{
+  change(default_action);
+  if (direct)
+    direct->changeActions(change);
   if (tree) {
-    TreeNode<KType,AType> *new_root = tree->changeActions(mappings);
+    tree_size = 0; // equal actions may have been merged
+    TreeNode<KType,AType> *new_root = tree->changeActions(change, arena);
     if(new_root->getType() == ACTION) {
       // The tree was compacted in a single ActionNode, therefore just
-      // extract the default action and check that it is equal to
-      // 'default_action' (it should be, because of the default semantics).
-      ActionNode<KType,AType> *new_root_as_actnode = dynamic_cast<ActionNode<KType, AType>*>(new_root);
-      if (!new_root_as_actnode) abort(); // something is wrong
-      if (default_action != new_root_as_actnode->getAction()) abort(); // this is wrong as well
+      // extract its action: since ranges can paint over the whole key
+      // space, it is not necessarily the old default action.
+      ActionNode<KType,AType> *new_root_as_actnode = static_cast<ActionNode<KType, AType>*>(new_root);
+      default_action = new_root_as_actnode->getAction();
+      arena->release(new_root_as_actnode);
       tree = NULL;
     } else {
-      tree = dynamic_cast<OpNode<KType, AType>*>(new_root);
-      if (!tree) abort(); //something broke, the cast above should be legal
+      // by construction, anything but an ActionNode is an OpNode
+      tree = static_cast<OpNode<KType, AType>*>(new_root);
     }
   }
 }
 
+/* returns a flattened, read-only copy of this Range, optimized for lookups */
+template <class KType, class AType>
+FrozenRange<KType,AType> Range<KType,AType>::freeze() const
+{
+  Linearization<KType,AType> lin;
+  linearize(lin);
+  return FrozenRange<KType,AType>(lin);
+}
+
+/* returns this Range lowered into a decision program, which can also be
+ * emitted as C++ source; the keys must be integral */
+template <class KType, class AType>
+DecisionProgram<KType,AType> Range<KType,AType>::compile(const CodegenCosts &costs) const
+{
+  Linearization<KType,AType> lin;
+  linearize(lin);
+  return DecisionProgram<KType,AType>(lin, costs);
+}
+
+/* writes this Range in the format of MappedRange, so that other
+ * processes can map it instead of building it again */
+template <class KType, class AType>
+void Range<KType,AType>::save(std::ostream &out) const
+{
+  Linearization<KType,AType> lin;
+  linearize(lin);
+  MappedRange<KType,AType>::write(lin, out);
+}
+
+/* the depth of the tree, and the number of segments of its leaves
+ * (adjacent segments with the same action are counted apart) */
+template <class KType, class AType>
+TreeShape Range<KType,AType>::shape() const
+{
+  TreeShape to_ret;
+  if (tree)
+    tree->measure(0, to_ret);
+  else
+    to_ret.leaf(0, 1);
+  return to_ret;
+}
+
+/* the nodes of the tree by type, the depth of its segments, and an
+ * estimate of the bytes held by the Range: its nodes, the entries of
+ * their maps and the direct index, if any. Shared nodes are counted
+ * once for each parent, and memory owned by the keys and the actions
+ * themselves (e.g. the characters of a string) is not counted. */
+template <class KType, class AType>
+typename Range<KType,AType>::Stats Range<KType,AType>::stats() const
+{
+  const TreeShape s = shape();
+  Stats to_ret;
+  to_ret.action_nodes = s.actions;
+  to_ret.range_nodes = s.ranges;
+  to_ret.punct_nodes = s.puncts;
+  to_ret.punct_entries = s.punct_entries;
+  to_ret.max_depth = s.depth;
+  to_ret.avg_depth = (double)s.depth_sum / s.segments;
+  // a map entry also holds a color and three pointers
+  const size_t entry_bytes = sizeof(std::pair<const KType,AType>) + 4 * sizeof(void*);
+  to_ret.bytes = sizeof(Range)
+    + s.actions * sizeof(ActionNode<KType,AType>)
+    + s.ranges * sizeof(RangeOpNode<KType,AType>)
+    + s.puncts * sizeof(PunctOpNode<KType,AType>)
+    + s.punct_entries * entry_bytes;
+  if (direct)
+    to_ret.bytes += direct->bytes();
+  return to_ret;
+}
+
+/* rebuilds the tree out of the minimal list of segments mapping the
+ * same keys to the same actions, and returns the number of segments */
+template <class KType, class AType>
+size_t Range<KType,AType>::rebuildCanonical()
+{
+  Linearization<KType,AType> lin;
+  linearize(lin);
+  lin.coalesce();
+  rebuild(lin);
+  return lin.actions.size();
+}
+
+/* replaces the tree with a height-balanced one with the same mappings,
+ * merging the adjacent segments that share their action */
+template <class KType, class AType>
+typename Range<KType,AType>::Balance Range<KType,AType>::rebalance()
+{
+  Balance to_ret;
+  to_ret.depth_before = shape().depth;
+  to_ret.segments = rebuildCanonical();
+  to_ret.depth_after = shape().depth;
+  return to_ret;
+}
+
+/* the same as rebalance(), reporting how many nodes were saved: any two
+ * adjacent segments with the same action are merged, wherever they lie
+ * in the tree, so the result is the same for all the Ranges mapping
+ * the same keys to the same actions */
+template <class KType, class AType>
+typename Range<KType,AType>::Minimization Range<KType,AType>::minimize()
+{
+  Minimization to_ret;
+  to_ret.nodes_before = (tree ? shape().nodes : 0);
+  to_ret.segments = rebuildCanonical();
+  to_ret.nodes_after = (tree ? shape().nodes : 0);
+  return to_ret;
+}
+
+/* the average number of key comparisons of a lookup, over the keys
+ * sampled in 'profile'; 0 if it holds no samples */
+template <class KType, class AType>
+double Range<KType,AType>::expectedComparisons(const RangeProfile<KType> &profile) const
+{
+  if (!tree || !profile.samples())
+    return 0;
+  double to_ret = 0;
+  for (typename std::map<KType,uint64_t>::const_iterator i = profile.hits().begin();
+       i != profile.hits().end(); ++i)
+    to_ret += (double)i->second * tree->comparisons(i->first);
+  return to_ret / profile.samples();
+}
+
+/* rebuilds the tree so that the segments hit most often in 'profile'
+ * lie closest to the root. Segments that were never hit weigh as much
+ * as a single hit, so they stay reachable in O(log n) when the profile
+ * is small. Later changes to the Range may rebalance the tree again. */
+template <class KType, class AType>
+typename Range<KType,AType>::Reoptimization Range<KType,AType>::reoptimize(const RangeProfile<KType> &profile)
+{
+  Reoptimization to_ret;
+  to_ret.compares_before = expectedComparisons(profile);
+
+  Linearization<KType,AType> lin;
+  linearize(lin);
+  lin.coalesce();
+  const std::vector<uint64_t> hits = profile.segmentHits(lin);
+  std::vector<double> weights(hits.size());
+  for (size_t i = 0; i < hits.size(); ++i)
+    weights[i] = (double)hits[i] + 1;
+  rebuild(lin, &weights);
+
+  to_ret.compares_after = expectedComparisons(profile);
+  to_ret.segments = lin.actions.size();
+  return to_ret;
+}
+
+template <class KType, class AType>
+void Range<KType,AType>::setDirectIndex(KType lo, KType hi)
+{
+  delete direct;
+  direct = new DirectIndex<KType,AType>(lo, hi);
+  refillDirectIndex();
+}
+
+template <class KType, class AType>
+void Range<KType,AType>::setDirectIndex()
+{
+  if (!std::numeric_limits<KType>::is_integer || std::numeric_limits<KType>::digits > 16)
+    abort(); // the whole domain is too large for a table
+  setDirectIndex(std::numeric_limits<KType>::min(), std::numeric_limits<KType>::max());
+}
+
+template <class KType, class AType>
+void Range<KType,AType>::clearDirectIndex()
+{
+  delete direct;
+  direct = NULL;
+}
+
+template <class KType, class AType>
+void Range<KType,AType>::refillDirectIndex()
+{
+  if (!direct)
+    return;
+  Linearization<KType,AType> lin;
+  linearize(lin);
+  direct->fill(lin);
+}
+
+/* takes the settings of 'first', the first input of the intersection
+ * that built this Range, and applies them to the result */
+template <class KType, class AType>
+void Range<KType,AType>::finishIntersection(const Range &first)
+{
+  rebalance_factor = first.rebalance_factor;
+  minimize_intersections = first.minimize_intersections;
+  if (!tree)
+    return;
+  if (minimize_intersections)
+    minimize();
+  if (rebalance_factor <= 0)
+    return;
+  const TreeShape s = shape();
+  double limit = 1;
+  for (size_t n = s.segments; n > 1; n >>= 1)
+    limit += rebalance_factor;
+  if (s.depth > limit)
+    rebalance();
+}
+
+/* replaces the tree with a balanced one, built out of 'lin' */
+template <class KType, class AType>
+void Range<KType,AType>::rebuild(const Linearization<KType,AType> &lin, const std::vector<double> *weights)
+{
+  if (tree)
+    arena->releaseTree(tree);
+  tree = NULL;
+  tree_size = 0;
+
+  if (lin.cuts.empty()) {
+    // a single segment: the default action is the only reachable one
+    default_action = lin.actions[0];
+    return;
+  }
+  if (weights)
+    tree = static_cast<OpNode<KType,AType>*>(TreeBuilder<KType,AType>::build(lin, *weights, ownArena()));
+  else
+    tree = static_cast<OpNode<KType,AType>*>(TreeBuilder<KType,AType>::build(lin, ownArena()));
+  // a node for each cut and one for each segment
+  tree_size = lin.cuts.size() + lin.actions.size();
+}
+
+/* the size of the tree, counted only after changes that did not keep it */
+template <class KType, class AType>
+size_t Range<KType,AType>::treeSize()
+{
+  if (tree && !tree_size)
+    tree_size = TreeOverlay<KType,AType>::treeSize(tree);
+  return tree_size;
+}
+
+/* the arena for new nodes; a moved-from Range gets a new one here */
+template <class KType, class AType>
+NodeArena<KType,AType>* Range<KType,AType>::ownArena()
+{
+  if (!arena)
+    arena = new NodeArena<KType,AType>();
+  return arena;
+}
+
+template <class KType, class AType>
+void Range<KType,AType>::linearize(Linearization<KType,AType> &out) const
+{
+  if (tree)
+    tree->linearize(NULL, NULL, out);
+  else
+    out.append(NULL, default_action);
+}
+
 #endif /* RANGE_HPP_INCLUDED */
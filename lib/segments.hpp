@@ -0,0 +1,278 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SEGMENTS_HPP_INCLUDED
+#define SEGMENTS_HPP_INCLUDED
+
+#include <iterator>
+#include <map>
+#include <vector>
+#include "internals.hpp"
+
+/* A maximal run of keys mapped by a tree to the same leaf: the keys
+ * between 'low' and 'high', each one included when its flag is set.
+ * A NULL bound is unbounded. The bounds point into the tree, so they
+ * stay valid until the Range is modified or destroyed.
+ */
+template <class KType, class AType>
+struct Segment
+{
+  const KType *low;
+  bool low_incl;
+  const KType *high;
+  bool high_incl;
+  AType action;
+
+  Segment() : low(NULL), low_incl(false), high(NULL), high_incl(false), action() {}
+};
+
+/* Walks a tree in key order, yielding its non-empty segments one at a
+ * time: the same ones Range::linearize() collects, adjacent segments
+ * with the same action included. The path still to be walked is kept
+ * on an explicit stack, and nodes are told apart by their Node_t, as in
+ * TreeNode::find(). Any change to the Range invalidates its iterators.
+ */
+template <class KType, class AType>
+class SegmentIterator
+{
+public:
+  typedef std::forward_iterator_tag iterator_category;
+  typedef Segment<KType,AType> value_type;
+  typedef ptrdiff_t difference_type;
+  typedef const Segment<KType,AType>* pointer;
+  typedef const Segment<KType,AType>& reference;
+
+  // the end of any walk
+  SegmentIterator() : index(0), done(true), has_floor(false), floor(NULL), floor_incl(false) {}
+  // the first segment of 'root', or of the whole key space mapped to
+  // 'dfl_action' when 'root' is NULL
+  SegmentIterator(const TreeNode<KType,AType> *root, const AType &dfl_action)
+    : dfl_action(dfl_action), index(0), done(false), has_floor(false), floor(NULL), floor_incl(false)
+  {
+    Frame top;
+    top.node = root;
+    top.lo = top.hi = NULL;
+    top.lo_incl = top.hi_incl = false;
+    top.started = false;
+    top.below_done = false;
+    stack.push_back(top);
+    advance();
+  }
+
+  reference operator*() const { return current; }
+  pointer operator->() const { return &current; }
+  SegmentIterator& operator++() {
+    advance();
+    return *this;
+  }
+  SegmentIterator operator++(int) {
+    SegmentIterator to_ret(*this);
+    advance();
+    return to_ret;
+  }
+  // iterators over the same tree compare by position
+  bool operator==(const SegmentIterator &other) const {
+    return done == other.done && (done || index == other.index);
+  }
+  bool operator!=(const SegmentIterator &other) const { return !(*this == other); }
+
+private:
+  typedef typename std::map<KType,AType>::const_iterator punct_iter_t;
+
+  /* a subtree still to be walked, restricted to the keys between the
+   * cuts 'lo' and 'hi' (NULL means unbounded); a PunctOpNode is walked
+   * one punctual value at a time, so its frame keeps its position */
+  struct Frame {
+    const TreeNode<KType,AType> *node;
+    const KType *lo;
+    bool lo_incl;
+    const KType *hi;
+    bool hi_incl;
+    bool started;
+    // PunctOpNode(s) only: the next punctual value, and whether the
+    // segment below it was yielded already
+    punct_iter_t next;
+    bool below_done;
+  };
+
+  std::vector<Frame> stack;
+  AType dfl_action;
+  Segment<KType,AType> current;
+  size_t index;
+  bool done;
+  // the upper cut of the last segment yielded
+  bool has_floor;
+  const KType *floor;
+  bool floor_incl;
+
+  // the same as Cut::operator<
+  static inline bool cutLess(const KType *a, bool a_incl, const KType *b, bool b_incl) {
+    if (*a < *b)
+      return true;
+    if (*b < *a)
+      return false;
+    return (!a_incl && b_incl);
+  }
+  // the same as Cut::below
+  static inline bool cutBelow(const KType *cut, bool incl, const KType &k) {
+    return (k < *cut || (incl && k == *cut));
+  }
+
+  /* The same as Linearization::append(): closes the segment that starts
+   * at the last cut at 'hi', unless it is empty. Returns true when there
+   * is a new segment. */
+  bool close(const KType *hi, bool hi_incl, const AType &action) {
+    if (hi && has_floor && !cutLess(floor, floor_incl, hi, hi_incl))
+      return false;
+    current.low = (has_floor ? floor : NULL);
+    current.low_incl = (has_floor && !floor_incl);
+    current.high = hi;
+    current.high_incl = (hi && hi_incl);
+    current.action = action;
+    if (hi) {
+      has_floor = true;
+      floor = hi;
+      floor_incl = hi_incl;
+    }
+    return true;
+  }
+
+  void advance();
+};
+
+/* The segments of a Range, for walking them with iterators or, since
+ * C++11, with a range-based for */
+template <class KType, class AType>
+class Segments
+{
+public:
+  typedef SegmentIterator<KType,AType> iterator;
+  typedef SegmentIterator<KType,AType> const_iterator;
+
+  Segments(const TreeNode<KType,AType> *root, const AType &dfl_action)
+    : root(root), dfl_action(dfl_action) {}
+
+  iterator begin() const { return iterator(root, dfl_action); }
+  iterator end() const { return iterator(); }
+
+private:
+  const TreeNode<KType,AType> *root;
+  AType dfl_action;
+};
+
+
+/* == template implementation follows == */
+template <class KType, class AType>
+void SegmentIterator<KType,AType>::advance()
+{
+  while (!stack.empty()) {
+    Frame &f = stack.back();
+    if (!f.node) {
+      // an empty Range
+      const bool yielded = close(f.hi, f.hi_incl, dfl_action);
+      stack.pop_back();
+      if (yielded) {
+        ++index;
+        return;
+      }
+      continue;
+    }
+
+    switch (f.node->getType()) {
+    case ACTION:
+      {
+        const AType &action = static_cast<const ActionNode<KType,AType>*>(f.node)->action;
+        const KType *hi = f.hi;
+        const bool hi_incl = f.hi_incl;
+        stack.pop_back();
+        if (close(hi, hi_incl, action)) {
+          ++index;
+          return;
+        }
+      }
+      break;
+
+    case RANGE:
+      {
+        // the same split as RangeOpNode::linearize(), the left side on top
+        const RangeOpNode<KType,AType> *range = static_cast<const RangeOpNode<KType,AType>*>(f.node);
+        const KType *sep = &range->range_separator;
+        const bool sep_incl = (range->getNormalizedOp() == LESS_EQUAL_THAN);
+        const Frame parent = f;
+        stack.pop_back();
+        if (!parent.hi || cutLess(sep, sep_incl, parent.hi, parent.hi_incl)) {
+          Frame right = parent;
+          right.node = range->right_interval();
+          if (!parent.lo || cutLess(parent.lo, parent.lo_incl, sep, sep_incl)) {
+            right.lo = sep;
+            right.lo_incl = sep_incl;
+          }
+          stack.push_back(right);
+        }
+        if (!parent.lo || cutLess(parent.lo, parent.lo_incl, sep, sep_incl)) {
+          Frame left = parent;
+          left.node = range->left_interval();
+          if (!parent.hi || cutLess(sep, sep_incl, parent.hi, parent.hi_incl)) {
+            left.hi = sep;
+            left.hi_incl = sep_incl;
+          }
+          stack.push_back(left);
+        }
+      }
+      break;
+
+    case PUNCTUAL:
+      {
+        // the same segments as PunctOpNode::linearize(), one per call
+        const PunctOpNode<KType,AType> *punct = static_cast<const PunctOpNode<KType,AType>*>(f.node);
+        if (!f.started) {
+          f.started = true;
+          f.next = punct->others.begin();
+          f.below_done = false;
+          while (f.lo && f.next != punct->others.end() && cutBelow(f.lo, f.lo_incl, f.next->first))
+            ++f.next;
+        }
+        bool yielded;
+        if (f.next == punct->others.end() || (f.hi && !cutBelow(f.hi, f.hi_incl, f.next->first))) {
+          yielded = close(f.hi, f.hi_incl, punct->dflAction());
+          stack.pop_back();
+        } else if (!f.below_done) {
+          f.below_done = true;
+          yielded = close(&f.next->first, false, punct->dflAction());
+        } else {
+          yielded = close(&f.next->first, true, f.next->second);
+          f.below_done = false;
+          ++f.next;
+        }
+        if (yielded) {
+          ++index;
+          return;
+        }
+      }
+      break;
+
+    default:
+      abort();
+    }
+  }
+  done = true;
+}
+
+#endif /* SEGMENTS_HPP_INCLUDED */
@@ -0,0 +1,188 @@
+/*
+ librange
+ Copyright (C) 2011 Marco Leogrande
+
+ This file is part of librange.
+
+ librange is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ librange is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIEW_HPP_INCLUDED
+#define VIEW_HPP_INCLUDED
+
+#include <map>
+#include "range.hpp"
+
+/* The intersection of two Ranges, kept up to date while they change.
+ * The view holds its two inputs, as copies sharing their nodes, and
+ * the merger; the inputs are modified through the view, which patches
+ * the result instead of intersecting them again.
+ * When input 0 gets addRange(op, key, x), only the keys satisfying 'op'
+ * change in the result, and there they map to merger(x, y) for each
+ * action y that input 1 has over them. Those segments of input 1 are
+ * read off its tree, skipping the subtrees that lie out of the painted
+ * interval, merged, built into a balanced subtree, and grafted over the
+ * result where Range::addRange() would paint a single action; the rest
+ * of the result is left as it is.
+ * The view counts the trees of the inputs and of the result once, when
+ * they are built, so that painting them never walks them again; after
+ * that an update costs amortized O(m + log n), m being the number of
+ * segments of the other input that the painted interval crosses: a
+ * single key, or a cut crossing few segments, is O(log n), instead of
+ * the O(n) of a new intersect(). Changes to input 1 are symmetric.
+ * changeActions() can change any key, so it intersects again.
+ */
+template <class KType, class AType, class Merger = FunctionMerger<AType> >
+class IntersectionView
+{
+  typedef AType(*merger_func_t)(const AType, const AType, void*);
+
+public:
+  IntersectionView(const Range<KType,AType> &a, const Range<KType,AType> &b, Merger merger)
+    : merger(merger), a(a), b(b), result(Range<KType,AType>::intersect(a, b, merger)),
+      merged_default(merge(0, a.default_action, b.default_action)) { countTrees(); }
+  // only for the default Merger
+  IntersectionView(const Range<KType,AType> &a, const Range<KType,AType> &b, merger_func_t merger, void *extra_info)
+    : merger(merger, extra_info), a(a), b(b), result(Range<KType,AType>::intersect(a, b, this->merger)),
+      merged_default(merge(0, a.default_action, b.default_action)) { countTrees(); }
+
+  // the intersection of the inputs, as they are now
+  const Range<KType,AType>& get() const { return result; }
+  // input 0 or 1
+  const Range<KType,AType>& input(size_t which) const {
+    if (which > 1)
+      abort();
+    return (which == 0 ? a : b);
+  }
+
+  // the same as input(which).addRange(op, key, action), with the
+  // result patched to match
+  void addRange(size_t which, RangeOperator_t op, KType key, AType action);
+  // the same as input(which).changeActions(...), followed by a new
+  // intersection
+  void changeActions(size_t which, const std::map<AType,AType> &mappings);
+  template <class Mapper>
+  void changeActions(size_t which, Mapper mapper);
+
+private:
+  Merger merger;
+  Range<KType,AType> a;
+  Range<KType,AType> b;
+  Range<KType,AType> result;
+  // the default actions of the inputs, merged
+  AType merged_default;
+
+  Range<KType,AType>& changing(size_t which) {
+    if (which > 1)
+      abort();
+    return (which == 0 ? a : b);
+  }
+
+  // the actions merged in the order of the inputs
+  inline AType merge(size_t which, const AType &changed, const AType &other) {
+    RANGE_COUNT(merger_calls);
+    return (which == 0 ? merger(changed, other) : merger(other, changed));
+  }
+  void intersectAgain() {
+    result = Range<KType,AType>::intersect(a, b, merger);
+    merged_default = merge(0, a.default_action, b.default_action);
+    countTrees();
+  }
+  void countTrees() {
+    a.treeSize();
+    b.treeSize();
+    result.treeSize();
+  }
+};
+
+
+/* == template implementation follows == */
+template <class KType, class AType, class Merger>
+void IntersectionView<KType,AType,Merger>::addRange(size_t which, RangeOperator_t op, KType key, AType action)
+{
+  changing(which).addRange(op, key, action);
+  // an input changes its default action only when painted all over
+  if (!changing(which).tree)
+    merged_default = merge(0, a.default_action, b.default_action);
+  const Range<KType,AType> &other = (which == 0 ? b : a);
+
+  if (op == EQUAL) {
+    result.addRange(EQUAL, key, merge(which, action, other.find(key)));
+  } else {
+    // the painted keys lie below 'cut', or above it
+    const bool below = (op == LESS_THAN || op == LESS_EQUAL_THAN);
+    if (!below && op != GREAT_THAN && op != GREAT_EQUAL_THAN)
+      abort();
+    const Cut<KType> cut(key, op == LESS_EQUAL_THAN || op == GREAT_THAN);
+
+    // the segments of 'other' between 'cut' and the end of the key space
+    // on the painted side, in key order
+    Linearization<KType,AType> crossed;
+    if (below) {
+      if (other.tree)
+        other.tree->linearize(NULL, &cut, crossed);
+      else
+        crossed.append(&cut, other.default_action);
+    } else {
+      crossed.floor = &cut;
+      if (other.tree)
+        other.tree->linearize(&cut, NULL, crossed);
+      else
+        crossed.append(NULL, other.default_action);
+    }
+    crossed.coalesce();
+    if (below)
+      crossed.cuts.pop_back(); // 'cut' itself: the subtree is only reached below it
+
+    for (size_t i = 0; i < crossed.actions.size(); ++i)
+      crossed.actions[i] = merge(which, action, crossed.actions[i]);
+    crossed.coalesce();
+    if (crossed.cuts.empty()) {
+      result.addRange(op, key, crossed.actions[0]);
+    } else {
+      TreeNode<KType,AType> *root = result.tree;
+      size_t size = 1;
+      if (root)
+        size = result.treeSize();
+      else
+        root = result.arena->newAction(result.default_action);
+      TreeNode<KType,AType> *painted = TreeBuilder<KType,AType>::build(crossed, result.arena);
+      result.tree = static_cast<OpNode<KType,AType>*>(TreeOverlay<KType,AType>::graft(root, op, key, painted, result.arena, size));
+      result.tree_size = size;
+      result.refillDirectIndex();
+    }
+  }
+
+  // the default action of the result follows the ones of the inputs,
+  // as in intersect(), unless the result was painted all over
+  if (result.tree)
+    result.default_action = merged_default;
+}
+
+template <class KType, class AType, class Merger>
+void IntersectionView<KType,AType,Merger>::changeActions(size_t which, const std::map<AType,AType> &mappings)
+{
+  changing(which).changeActions(mappings);
+  intersectAgain();
+}
+
+template <class KType, class AType, class Merger>
+template <class Mapper>
+void IntersectionView<KType,AType,Merger>::changeActions(size_t which, Mapper mapper)
+{
+  changing(which).changeActions(mapper);
+  intersectAgain();
+}
+
+#endif /* VIEW_HPP_INCLUDED */
@@ -19,9 +19,18 @@
 */
 
 #include "range.hpp"
+#include "interned.hpp"
+#include "builder.hpp"
+#include "view.hpp"
 #include <string>
 #include <iostream>
 #include <stack>
+#include <vector>
+#include <limits>
+#include <sstream>
+#include <utility>
+#include <stdlib.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -51,6 +60,144 @@ void print_mapping(Range<string,string> &map, string key){
 void print_mapping_int(Range<int,string> &map, int key){
   cout << "'" << key << "' mapped to: '" << map.find(key) << "'" << endl;
 }
+void print_mapping_frozen(FrozenRange<int,string> &map, int key){
+  cout << "'" << key << "' mapped to: '" << map.find(key) << "'" << endl;
+}
+void check_frozen_int(Range<int,string> &map, FrozenRange<int,string> &frozen, int from, int to){
+  int mismatches = 0;
+  for (int key = from; key <= to; ++key)
+    if (map.find(key) != frozen.find(key))
+      ++mismatches;
+  cout << "frozen segments: " << frozen.segments() << ", mismatches in ["
+       << from << ", " << to << "]: " << mismatches << endl;
+}
+int sum(const int a, const int b, void *other){ return a + b; }
+int sum_parity(const int a, const int b, void *other){ return (a + b) % 2; }
+int counting_sum(const int a, const int b, void *calls){ ++*(int*)calls; return a + b; }
+// the same as counting_sum, as a functor: copies share the count
+struct CountingSum {
+  int *calls;
+  explicit CountingSum(int *calls) : calls(calls) {}
+  int operator()(const int &a, const int &b) const { ++*calls; return a + b; }
+};
+// counts the nodes a traversal visits, by kind
+struct NodeCounts {
+  int ranges, puncts, entries, actions;
+  NodeCounts() : ranges(0), puncts(0), entries(0), actions(0) {}
+};
+struct CountRange {
+  NodeCounts *counts;
+  void operator()(RangeOperator_t op, const int &key) const { ++counts->ranges; }
+};
+struct CountPunct {
+  NodeCounts *counts;
+  void operator()(RangeOperator_t op, const std::map<int,int> &others) const { ++counts->puncts; counts->entries += others.size(); }
+};
+struct CountAction {
+  NodeCounts *counts;
+  void operator()(const int &action) const { ++counts->actions; }
+};
+struct Scale {
+  int multiply, divide;
+  int operator()(const int &action) const { return action * multiply / divide; }
+};
+void check_same_int(Range<int,int> &map, Range<int,int> &other, int from, int to){
+  int mismatches = 0;
+  for (int key = from; key <= to; ++key)
+    if (map.find(key) != other.find(key))
+      ++mismatches;
+  cout << "mismatches in [" << from << ", " << to << "]: " << mismatches << endl;
+}
+// a Range over [0, 100) out of a linear congruential generator
+Range<int,int> random_int_range(unsigned &seed, int ranges, int points){
+  Range<int,int> r(0);
+  for (int i = 0; i < ranges + points; ++i) {
+    seed = seed * 1103515245 + 12345;
+    const int key = (seed >> 16) % 100;
+    r.addRange(i < ranges ? (RangeOperator_t)((seed >> 8) % 4) : EQUAL, key, (seed >> 4) % 8);
+  }
+  return r;
+}
+template <class KType, class AType>
+void check_compiled(Range<KType,AType> &map, DecisionProgram<KType,AType> &program, KType from, KType to){
+  int mismatches = 0;
+  for (KType key = from; ; ++key) {
+    if (map.find(key) != program.find(key))
+      ++mismatches;
+    if (key == to)
+      break;
+  }
+  cout << "compiled mismatches in [" << +from << ", " << +to << "]: " << mismatches << endl;
+}
+template <class KType>
+void check_same_keys(Range<KType,int> &map, Range<KType,int> &other, KType from, KType to){
+  int mismatches = 0;
+  for (KType key = from; ; ++key) {
+    if (map.find(key) != other.find(key))
+      ++mismatches;
+    if (key == to)
+      break;
+  }
+  cout << "mismatches in [" << +from << ", " << +to << "]: " << mismatches << endl;
+}
+template <class KType, class AType>
+void check_mapped(Range<KType,AType> &map, MappedRange<KType,AType> &mapped, KType from, KType to){
+  int mismatches = 0;
+  for (KType key = from; key <= to; ++key)
+    if (map.find(key) != mapped.find(key))
+      ++mismatches;
+  if (map.find(numeric_limits<KType>::min()) != mapped.find(numeric_limits<KType>::min()))
+    ++mismatches;
+  if (map.find(numeric_limits<KType>::max()) != mapped.find(numeric_limits<KType>::max()))
+    ++mismatches;
+  cout << "mapped mismatches in [" << from << ", " << to << "]: " << mismatches << endl;
+}
+void print_segments_int(const Range<int,string> &map){
+  Segments<int,string> segments = map.segments();
+  for (Segments<int,string>::iterator i = segments.begin(); i != segments.end(); ++i) {
+    cout << (i->low_incl ? "[" : "(");
+    if (i->low) cout << *i->low; else cout << "-inf";
+    cout << ", ";
+    if (i->high) cout << *i->high; else cout << "+inf";
+    cout << (i->high_incl ? "]" : ")") << " => " << i->action << endl;
+  }
+}
+// walks the segments of 'map' along with the keys in [from, to]
+int check_segments_int(Range<int,int> &map, int from, int to){
+  int mismatches = 0;
+  Segments<int,int> segments = map.segments();
+  Segments<int,int>::iterator i = segments.begin();
+  for (int key = from; key <= to; ++key) {
+    while (i != segments.end() && i->high && (*i->high < key || (*i->high == key && !i->high_incl)))
+      ++i;
+    if (i == segments.end() || (i->low && (key < *i->low || (key == *i->low && !i->low_incl)))
+        || i->action != map.find(key))
+      ++mismatches;
+  }
+  return mismatches;
+}
+template <class Stats>
+void print_program_stats(const Stats &stats){
+  cout << "segments: " << stats.segments << ", compares: " << stats.compares
+       << ", tables: " << stats.tables << " (" << stats.table_entries << " entries)"
+       << ", bit tests: " << stats.bit_groups << " (" << stats.masks << " masks)"
+       << ", max branches: " << stats.max_branches << endl;
+}
+void check_batch_int(Range<int,string> &map, int from, int to){
+  vector<int> keys;
+  keys.push_back(numeric_limits<int>::min());
+  for (int key = from; key <= to; ++key)
+    keys.push_back(key);
+  keys.push_back(numeric_limits<int>::max());
+  vector<string> out(keys.size());
+  map.freeze().findBatch(&keys[0], keys.size(), &out[0]);
+
+  int mismatches = 0;
+  for (size_t i = 0; i < keys.size(); ++i)
+    if (map.find(keys[i]) != out[i])
+      ++mismatches;
+  cout << "batch of " << keys.size() << " keys, mismatches: " << mismatches << endl;
+}
 void print_all_int(Range<int,string> &map){
   std::set<string> ret_set = map.findAll();
   int i = 0;
@@ -293,4 +440,608 @@ int main(){
   print_mapping_int(*rint12_ptr, v_c);
   print_all_int(*rint12_ptr);
   do_traversal_int(*rint12_ptr);
+
+  cout << "======== rint13, rint1 intersected in place with rint2 and rint3 ========" << endl;
+  Range<int,string> rint13(rint1);
+  rint13.intersectWith(rint2, &MyTest::mywrapper, NULL);
+  rint13.intersectWith(rint3, &MyTest::mywrapper, NULL);
+  print_mapping_int(rint13, v_a);
+  print_mapping_int(rint13, v_b);
+  print_mapping_int(rint13, v_c);
+  print_all_int(rint13);
+  do_traversal_int(rint13);
+
+  cout << "======== rint14, as rint12_ptr but with a sweep ========" << endl;
+  Range<int,string> rint14 = Range<int,string>::intersectSweep(rint6, rint11, &MyTest::mywrapper, NULL);
+  print_mapping_int(rint14, v_a);
+  print_mapping_int(rint14, v_b);
+  print_mapping_int(rint14, v_c);
+  print_all_int(rint14);
+  do_traversal_int(rint14);
+
+  cout << "======== sweep against tree, with a commutative merger ========" << endl;
+  Range<int,int> sum1(1), sum2(10), sum3(100);
+  sum1.addRange(LESS_THAN, v_b, 2);
+  sum2.addRange(EQUAL, v_a, 20);
+  sum3.addRange(GREAT_EQUAL_THAN, v_c, 200);
+  Range<int,int> sum12 = Range<int,int>::intersect(sum1, sum2, &sum, NULL);
+  Range<int,int> sum123 = Range<int,int>::intersect(sum12, sum3, &sum, NULL);
+  Range<int,int> sweep12 = Range<int,int>::intersectSweep(sum1, sum2, &sum, NULL);
+  Range<int,int> sweep123 = Range<int,int>::intersectSweep(sweep12, sum3, &sum, NULL);
+  check_same_int(sweep12, sum12, 0, 40000);
+  check_same_int(sweep123, sum123, 0, 40000);
+
+  cout << "======== n-way intersection ========" << endl;
+  vector<Range<int,int> > sums;
+  for (int i = 0; i < 8; ++i) {
+    sums.push_back(Range<int,int>(i));
+    if (i == 3)
+      sums.back().addRange(EQUAL, 80, 1000);
+    else
+      sums.back().addRange((i % 2 ? GREAT_THAN : LESS_EQUAL_THAN), 100 * i, 10 * i);
+  }
+  int fold_calls = 0, all_calls = 0;
+  Range<int,int> fold = sums[0];
+  for (size_t i = 1; i < sums.size(); ++i)
+    fold = Range<int,int>::intersect(fold, sums[i], &counting_sum, &fold_calls);
+  Range<int,int> all = Range<int,int>::intersectAll(sums.begin(), sums.end(), &counting_sum, &all_calls);
+  int reordered_calls = 0;
+  Range<int,int> reordered = Range<int,int>::intersectAll(sums.begin(), sums.end(), &counting_sum, &reordered_calls, true);
+  cout << "merger calls, fold: " << fold_calls << ", intersectAll: " << all_calls
+       << ", reordered: " << reordered_calls << endl;
+  check_same_int(all, fold, -100, 1000);
+  check_same_int(reordered, fold, -100, 1000);
+
+#if __cplusplus >= 201103L
+  cout << "======== parallel intersection ========" << endl;
+  Range<int,int> steps_a(0), steps_b(0);
+  for (int i = 0; i < 64; ++i) {
+    Range<int,int> step_a(0), step_b(0);
+    step_a.addRange(LESS_THAN, (i * 7919) % 4000, 1);
+    step_b.addRange(GREAT_EQUAL_THAN, (i * 104729) % 4000, i);
+    steps_a = Range<int,int>::intersect(steps_a, step_a, &sum, NULL);
+    steps_b = Range<int,int>::intersect(steps_b, step_b, &sum, NULL);
+  }
+  WorkPool pool(3);
+  Range<int,int> serial = Range<int,int>::intersect(steps_a, steps_b, &sum, NULL);
+  Range<int,int> parallel = Range<int,int>::intersectParallel(steps_a, steps_b, &sum, NULL, pool);
+  Range<int,int> swept = Range<int,int>::intersectSweep(steps_a, steps_b, &sum, NULL);
+  check_same_int(serial, swept, -100, 4100);
+  check_same_int(parallel, serial, -100, 4100);
+
+  cout << "======== moved-from Ranges ========" << endl;
+  Range<int,int> moved = serial;
+  Range<int,int> moved_to(std::move(moved));
+  check_same_int(moved_to, serial, -100, 4100);
+  cout << "left empty: " << (moved.find(1000) == 0 && moved.findAll().size() == 1) << endl;
+  Range<int,int> moved_twice(std::move(moved_to));
+  Range<int,int> copied_empty = moved_to;
+  copied_empty.intersectWith(serial, &sum, NULL);
+  check_same_int(copied_empty, serial, -100, 4100);
+  moved_to = std::move(moved_twice);
+  moved.addRange(GREAT_THAN, 10, 5);
+  Range<int,int> moved_copy = moved;
+  cout << "still usable: " << moved_copy.find(11) << " " << moved_copy.find(10) << endl;
+  moved_to = std::move(moved);
+  cout << "after assignment: " << moved_to.find(11) << endl;
+  static_assert(std::is_nothrow_move_constructible<Range<int,string> >::value, "moving a Range cannot throw");
+  vector<Range<int,int> > grown;
+  for (int i = 0; i < 33; ++i) {
+    grown.push_back(Range<int,int>(i));
+    grown.back().addRange(LESS_THAN, i, i + 1);
+  }
+  cout << "moved by a growing vector: " << grown[0].find(-1) << " " << grown[32].find(31) << " " << grown[32].find(32) << endl;
+#endif
+
+  cout << "======== memoized intersection ========" << endl;
+  int plain_calls = 0, cached_calls = 0;
+  MergeCache<int> session;
+  Range<int,int> plain = sums[0], cached = sums[0];
+  for (size_t i = 1; i < sums.size(); ++i) {
+    plain = Range<int,int>::intersect(plain, sums[i], &counting_sum, &plain_calls);
+    cached = Range<int,int>::intersect(cached, sums[i], &counting_sum, &cached_calls, session);
+  }
+  cout << "merger calls, plain: " << plain_calls << ", cached: " << cached_calls
+       << ", hits: " << session.hits() << ", misses: " << session.misses() << endl;
+  check_same_int(cached, plain, -100, 1000);
+  // the same chain again, answered by the cache alone
+  cached_calls = 0;
+  cached = sums[0];
+  for (size_t i = 1; i < sums.size(); ++i)
+    cached.intersectWith(sums[i], &counting_sum, &cached_calls, session);
+  cout << "merger calls, second pass: " << cached_calls << endl;
+  check_same_int(cached, plain, -100, 1000);
+
+  cout << "======== copies share their nodes until modified ========" << endl;
+  Range<int,int> snapshot = fold;
+  Range<int,int> punct_a(0);
+  punct_a.addRange(EQUAL, 1, 10);
+  Range<int,int> punct_b(punct_a);
+  punct_b.addRange(EQUAL, 2, 20);
+  cout << "punct_a: " << punct_a.find(1) << " " << punct_a.find(2)
+       << ", punct_b: " << punct_b.find(1) << " " << punct_b.find(2) << endl;
+  map<int,int> shift;
+  shift[fold.find(500)] = -1;
+  snapshot.changeActions(shift);
+  cout << "changed copy at 500: " << snapshot.find(500) << ", original: " << fold.find(500) << endl;
+  check_same_int(fold, plain, -100, 1000);
+  snapshot = fold;
+  snapshot.intersectWith(sums[1], &sum, NULL);
+  check_same_int(fold, plain, -100, 1000);
+
+  cout << "======== rint5, interned ========" << endl;
+  ActionTable<string> table;
+  InternedRange<int,string> irint1(table, dfl_val_1), irint2(table, dfl_val_2), irint3(table, dfl_val_3);
+  irint1.addRange(LESS_THAN, v_b, less_than_1024);
+  irint2.addRange(EQUAL, v_a, eq_to_80);
+  irint3.addRange(GREAT_EQUAL_THAN, v_c, great_eq_32000);
+  InternedRange<int,string> irint5 =
+    InternedRange<int,string>::intersect(InternedRange<int,string>::intersect(irint1, irint2, &MyTest::mywrapper, NULL),
+                                         irint3, &MyTest::mywrapper, NULL);
+  int interned_mismatches = 0;
+  for (int key = 0; key <= 40000; ++key)
+    if (irint5.find(key) != rint5.find(key))
+      ++interned_mismatches;
+  cout << "distinct actions: " << table.size() << ", reachable: " << irint5.findAll().size()
+       << ", mismatches in [0, 40000]: " << interned_mismatches << endl;
+  const string held = irint5.find(v_a);
+  for (int i = 0; i < 100; ++i)
+    irint1.addRange(EQUAL, i, held + (char)('0' + i % 10));
+  map<string,string> renames;
+  renames["never interned"] = "renamed";
+  renames[held] = held + "!";
+  const size_t table_size = table.size();
+  irint5.changeActions(renames);
+  cout << "held across interning: " << (held == rint5.find(v_a)) << ", renamed: " << irint5.find(v_a)
+       << ", new actions: " << table.size() - table_size << endl;
+
+  cout << "======== many ranges in a single Range ========" << endl;
+  Range<int,int> painted(0);
+  painted.addRange(LESS_THAN, 5, 1);
+  painted.addRange(GREAT_THAN, 7, 2);
+  painted.addRange(LESS_EQUAL_THAN, 3, 3);
+  painted.addRange(GREAT_EQUAL_THAN, 9, 4);
+  painted.addRange(EQUAL, 6, 5);
+  painted.addRange(EQUAL, 4, 6);
+  for (int key = 0; key < 12; ++key)
+    cout << painted.find(key) << " ";
+  cout << endl;
+  painted.addRange(LESS_THAN, 7, 7);
+  painted.addRange(GREAT_THAN, 2, 8);
+  for (int key = 0; key < 12; ++key)
+    cout << painted.find(key) << " ";
+  cout << endl;
+  // the same steps as steps_a, painted over each other
+  Range<int,int> stairs(0), stairs_fold(0);
+  for (int i = 1; i <= 64; ++i) {
+    stairs.addRange(GREAT_EQUAL_THAN, i * 10, i);
+    Range<int,int> step(0);
+    step.addRange(GREAT_EQUAL_THAN, i * 10, 1);
+    stairs_fold = Range<int,int>::intersect(stairs_fold, step, &sum, NULL);
+  }
+  check_same_int(stairs, stairs_fold, -100, 1000);
+
+  cout << "======== bulk-loaded Range ========" << endl;
+  const RangeOperator_t all_ops[] = { LESS_THAN, LESS_EQUAL_THAN, GREAT_THAN, GREAT_EQUAL_THAN, EQUAL };
+  RangeBuilder<int,int> builder(0);
+  Range<int,int> incremental(0);
+  for (int i = 0; i < 500; ++i) {
+    // mostly points, with a half-line now and then
+    const RangeOperator_t op = (i % 25 ? EQUAL : all_ops[(i / 25) % 4]);
+    const int key = (op == EQUAL ? (i * 7919) % 1000 : (op == LESS_THAN || op == LESS_EQUAL_THAN ? i / 5 : 1000 - i / 5));
+    const int action = (i * 31) % 17;
+    builder.add(op, key, action);
+    incremental.addRange(op, key, action);
+  }
+  Range<int,int> bulk = builder.build();
+  RangeBuilder<int,int> no_entries(7);
+  cout << "built from no entries: " << no_entries.build().find(42) << endl;
+  check_same_int(bulk, incremental, -100, 1100);
+  FrozenRange<int,int> bulk_frozen = builder.freeze();
+  int bulk_mismatches = 0;
+  for (int key = -100; key <= 1100; ++key)
+    if (bulk_frozen.find(key) != incremental.find(key))
+      ++bulk_mismatches;
+  cout << "frozen segments: " << bulk_frozen.segments() << ", mismatches: " << bulk_mismatches << endl;
+
+  cout << "======== chains of random intersections ========" << endl;
+  // the merged trees hold separators that lie out of the bounds of
+  // their subtrees, which the next merges must cope with
+  unsigned seed = 1;
+  int chain_mismatches = 0;
+  for (int chain = 0; chain < 200; ++chain) {
+    Range<int,int> acc = random_int_range(seed, chain % 6, chain % 8);
+    // half of the chains rebalance their results as they go
+    if (chain % 2)
+      acc.setRebalanceFactor(2);
+    for (int step = 0; step < 8; ++step) {
+      Range<int,int> next = random_int_range(seed, (chain + step) % 6, (chain * step) % 8);
+      Range<int,int> merged = Range<int,int>::intersect(acc, next, &sum, NULL);
+      for (int key = -2; key < 102; ++key)
+        if (merged.find(key) != acc.find(key) + next.find(key))
+          ++chain_mismatches;
+      acc = merged;
+    }
+  }
+  cout << "mismatches: " << chain_mismatches << endl;
+
+  cout << "======== rebalancing intersection chains ========" << endl;
+  Range<int,int> zigzag(0);
+  for (int i = 0; i < 64; ++i) {
+    Range<int,int> step(0);
+    step.addRange((i % 2 ? GREAT_EQUAL_THAN : LESS_THAN), (i % 2 ? 1000 - i : i), 1 + i % 3);
+    zigzag = Range<int,int>::intersect(zigzag, step, &sum, NULL);
+  }
+  Range<int,int> unbalanced = zigzag;
+  Range<int,int>::Balance balance = zigzag.rebalance();
+  cout << "depth " << balance.depth_before << " -> " << balance.depth_after
+       << ", segments: " << balance.segments << endl;
+  check_same_int(zigzag, unbalanced, -100, 1100);
+  Range<int,int> zigzag_auto(0);
+  zigzag_auto.setRebalanceFactor(2);
+  for (int i = 0; i < 64; ++i) {
+    Range<int,int> step(0);
+    step.addRange((i % 2 ? GREAT_EQUAL_THAN : LESS_THAN), (i % 2 ? 1000 - i : i), 1 + i % 3);
+    zigzag_auto = Range<int,int>::intersect(zigzag_auto, step, &sum, NULL);
+  }
+  cout << "automatic, depth: " << zigzag_auto.shape().depth << endl;
+  check_same_int(zigzag_auto, unbalanced, -100, 1100);
+  // the setting is kept by intersectWith(), and not picked up from the
+  // second input
+  Range<int,int> zigzag_with(0), zigzag_second(0);
+  for (int i = 0; i < 64; ++i) {
+    Range<int,int> step(0);
+    step.setRebalanceFactor(2);
+    step.addRange((i % 2 ? GREAT_EQUAL_THAN : LESS_THAN), (i % 2 ? 1000 - i : i), 1 + i % 3);
+    zigzag_second = Range<int,int>::intersect(zigzag_second, step, &sum, NULL);
+    step.intersectWith(zigzag_with, &sum, NULL);
+    zigzag_with = step;
+  }
+  cout << "second input, depth: " << zigzag_second.shape().depth
+       << ", intersectWith: " << zigzag_with.shape().depth << endl;
+  check_same_int(zigzag_with, unbalanced, -100, 1100);
+  // a copy painted down to a few nodes shares its arena with the large
+  // tree it came from, which must not loosen its depth bound
+  Range<int,int> large(0);
+  for (int i = 0; i < 4000; ++i)
+    large.addRange(GREAT_THAN, 7 * i, 1 + i % 5);
+  Range<int,int> shrunk = large, alone(0);
+  shrunk.addRange(LESS_THAN, 1 << 30, 0);
+  for (int i = 0; i < 200; ++i) {
+    shrunk.addRange(LESS_THAN, 1000 - i, 1 + i % 3);
+    alone.addRange(LESS_THAN, 1000 - i, 1 + i % 3);
+  }
+  cout << "painted copy, depth: " << shrunk.shape().depth << ", alone: " << alone.shape().depth << endl;
+  check_same_int(shrunk, alone, -100, 1100);
+
+  cout << "======== minimizing intersection results ========" << endl;
+  // parity of the sum: most adjacent segments end up with the same action
+  Range<int,int> parity(0);
+  for (int i = 0; i < 64; ++i) {
+    Range<int,int> step(0);
+    step.addRange((i % 2 ? GREAT_EQUAL_THAN : LESS_THAN), (i % 2 ? 1000 - i : i), 1 + i % 3);
+    parity = Range<int,int>::intersect(parity, step, &sum, NULL);
+  }
+  Range<int,int> parity_full = parity;
+  parity = Range<int,int>::intersect(parity, Range<int,int>(0), &sum_parity, NULL);
+  Range<int,int> parity_copy = parity;
+  Range<int,int>::Minimization minimization = parity.minimize();
+  cout << "nodes " << minimization.nodes_before << " -> " << minimization.nodes_after
+       << ", segments: " << minimization.segments << endl;
+  check_same_int(parity, parity_copy, -100, 1100);
+  Range<int,int> zigzag_min(0);
+  zigzag_min.setMinimizeIntersections(true);
+  for (int i = 0; i < 64; ++i) {
+    Range<int,int> step(0);
+    step.addRange((i % 2 ? GREAT_EQUAL_THAN : LESS_THAN), (i % 2 ? 1000 - i : i), 1 + i % 3);
+    zigzag_min = Range<int,int>::intersect(zigzag_min, step, &sum, NULL);
+  }
+  cout << "automatic, nodes: " << zigzag_min.shape().nodes << endl;
+  check_same_int(zigzag_min, parity_full, -100, 1100);
+  // minimizing does not stand in for the rebalancing check
+  Range<int,int> zigzag_both(0);
+  zigzag_both.setMinimizeIntersections(true);
+  zigzag_both.setRebalanceFactor(2);
+  for (int i = 0; i < 64; ++i) {
+    Range<int,int> step(0);
+    step.addRange((i % 2 ? GREAT_EQUAL_THAN : LESS_THAN), (i % 2 ? 1000 - i : i), 1 + i % 3);
+    zigzag_both = Range<int,int>::intersect(zigzag_both, step, &sum, NULL);
+  }
+  cout << "with rebalancing, nodes: " << zigzag_both.shape().nodes
+       << ", depth: " << zigzag_both.shape().depth << endl;
+  check_same_int(zigzag_both, parity_full, -100, 1100);
+
+  cout << "======== compiled dispatchers ========" << endl;
+  Range<int,int> dispatch(0);
+  for (int i = 100; i <= 140; ++i)
+    dispatch.addRange(EQUAL, i, 1 + i % 5);      // dense: a jump table
+  for (int i = 1000; i <= 1020; i += 2)
+    dispatch.addRange(EQUAL, i, 7);              // two actions in 21 keys: bit tests
+  dispatch.addRange(EQUAL, 5000, 8);             // sparse: compares
+  dispatch.addRange(GREAT_EQUAL_THAN, 9000, 9);
+  DecisionProgram<int,int> program = dispatch.compile();
+  print_program_stats(program.stats());
+  check_compiled(dispatch, program, -100, 10000);
+  check_compiled(dispatch, program, numeric_limits<int>::min(), numeric_limits<int>::min() + 10);
+  check_compiled(dispatch, program, numeric_limits<int>::max() - 10, numeric_limits<int>::max());
+  CodegenCosts no_tables;
+  no_tables.max_table = 0;
+  print_program_stats(dispatch.compile(no_tables).stats());
+  Range<int,int> small(0);
+  small.addRange(LESS_THAN, -10, 1);
+  for (int i = 0; i < 6; ++i)
+    small.addRange(EQUAL, i, 2 + i % 2);
+  DecisionProgram<int,int> small_program = small.compile();
+  small_program.emit(cout, "dispatch_small", "int");
+  check_compiled(small, small_program, -100, 100);
+  DecisionProgram<int,string> program12 = rint12_ptr->compile();
+  print_program_stats(program12.stats());
+  check_compiled(*rint12_ptr, program12, 0, 40000);
+  Range<unsigned char,int> bytes(0);
+  bytes.addRange(GREAT_THAN, 250, 1);
+  bytes.addRange(EQUAL, 0, 2);
+  for (int i = 'a'; i <= 'z'; ++i)
+    bytes.addRange(EQUAL, (unsigned char)i, 3 + (i % 4 == 0));
+  DecisionProgram<unsigned char,int> byte_program = bytes.compile();
+  print_program_stats(byte_program.stats());
+  check_compiled(bytes, byte_program, (unsigned char)0, (unsigned char)255);
+
+  cout << "======== profile-guided layout ========" << endl;
+  Range<int,int> ports(0);
+  for (int i = 0; i < 1000; ++i)
+    ports.addRange(EQUAL, 3 * i, 1 + i % 7);
+  Range<int,int> ports_copy = ports;
+  RangeProfile<int> port_profile;
+  ports.setProfile(&port_profile);
+  // nine lookups out of ten go to two keys
+  for (int i = 0; i < 10000; ++i)
+    ports.find(i % 10 == 0 ? i % 3000 : (i % 2 ? 80 * 3 : 443 * 3));
+  ports.setProfile(NULL);
+  cout << "samples: " << port_profile.samples() << ", distinct keys: " << port_profile.hits().size() << endl;
+  Range<int,int>::Reoptimization reopt = ports.reoptimize(port_profile);
+  cout << "comparisons " << reopt.compares_before << " -> " << reopt.compares_after
+       << ", segments: " << reopt.segments << endl;
+  check_same_int(ports, ports_copy, -10, 3010);
+  stringstream saved;
+  port_profile.save(saved);
+  RangeProfile<int> loaded;
+  cout << "reloaded: " << loaded.load(saved) << ", samples: " << loaded.samples() << endl;
+  Range<int,int>::Reoptimization reopt_copy = ports_copy.reoptimize(loaded);
+  cout << "comparisons " << reopt_copy.compares_before << " -> " << reopt_copy.compares_after << endl;
+  RangeProfile<int> sampled(4);
+  ports.setProfile(&sampled);
+  for (int i = 0; i < 1000; ++i)
+    ports.find(i);
+  cout << "sampled one in four: " << sampled.samples() << endl;
+  stringstream garbage("12 3\nfoo 4\n");
+  cout << "malformed: " << loaded.load(garbage) << endl;
+
+  cout << "======== direct-indexed lookups ========" << endl;
+  Range<unsigned char,int> classes(0);
+  classes.setDirectIndex();
+  Range<unsigned char,int> classes_tree(0);
+  for (int i = 0; i < 40; ++i) {
+    RangeOperator_t op = (RangeOperator_t)(i % 5);
+    unsigned char key = (unsigned char)(i * 37 % 256);
+    classes.addRange(op, key, i % 6);
+    classes_tree.addRange(op, key, i % 6);
+  }
+  check_same_keys(classes, classes_tree, (unsigned char)0, (unsigned char)255);
+  map<int,int> reclassify;
+  reclassify[1] = 2;
+  reclassify[2] = 1;
+  reclassify[5] = 3;
+  classes.changeActions(reclassify);
+  classes_tree.changeActions(reclassify);
+  check_same_keys(classes, classes_tree, (unsigned char)0, (unsigned char)255);
+  Range<unsigned char,int> classes_copy = classes;
+  Range<unsigned char,int> other_classes(4);
+  other_classes.addRange(LESS_THAN, 100, 0);
+  classes_copy.intersectWith(other_classes, &sum, NULL);
+  classes_tree.intersectWith(other_classes, &sum, NULL);
+  cout << "copy indexed: " << classes_copy.hasDirectIndex() << endl;
+  check_same_keys(classes_copy, classes_tree, (unsigned char)0, (unsigned char)255);
+  Range<int,int> bounded(dispatch);
+  bounded.setDirectIndex(0, 1023);
+  bounded.addRange(GREAT_THAN, 1010, 11);
+  bounded.addRange(LESS_EQUAL_THAN, -5, 12);
+  Range<int,int> bounded_tree(dispatch);
+  bounded_tree.addRange(GREAT_THAN, 1010, 11);
+  bounded_tree.addRange(LESS_EQUAL_THAN, -5, 12);
+  check_same_keys(bounded, bounded_tree, -100, 2000);
+  bounded.clearDirectIndex();
+  cout << "cleared: " << !bounded.hasDirectIndex() << endl;
+
+  cout << "======== walking segments ========" << endl;
+  print_segments_int(*rint12_ptr);
+  print_segments_int(Range<int,string>("all"));
+  seed = 7;
+  int segment_mismatches = 0;
+  size_t walked = 0;
+  for (int n = 0; n < 100; ++n) {
+    Range<int,int> walk = random_int_range(seed, n % 7, n % 5);
+    walk.intersectWith(random_int_range(seed, n % 4, n % 6), &sum, NULL);
+    segment_mismatches += check_segments_int(walk, -2, 102);
+    Segments<int,int> segments = walk.segments();
+    walked += distance(segments.begin(), segments.end());
+  }
+  cout << "mismatches: " << segment_mismatches << ", segments: " << walked << endl;
+
+  cout << "======== footprint statistics ========" << endl;
+  Range<int,int> footprint(0);
+  Range<int,int>::Stats empty_stats = footprint.stats();
+  cout << "empty: " << empty_stats.action_nodes + empty_stats.range_nodes + empty_stats.punct_nodes
+       << " nodes, depth " << empty_stats.max_depth << endl;
+  footprint.addRange(LESS_THAN, 10, 1);
+  footprint.addRange(GREAT_THAN, 20, 2);
+  footprint.addRange(EQUAL, 15, 3);
+  footprint.addRange(EQUAL, 17, 4);
+  Range<int,int>::Stats stats = footprint.stats();
+  cout << "actions: " << stats.action_nodes << ", ranges: " << stats.range_nodes
+       << ", punctuals: " << stats.punct_nodes << " holding " << stats.punct_entries
+       << ", depth: " << stats.max_depth << " (" << stats.avg_depth << " on average)" << endl;
+  cout << "bytes grow with the nodes: " << (stats.bytes > empty_stats.bytes) << endl;
+  footprint.setDirectIndex(0, 1023);
+  cout << "and with a direct index: " << (footprint.stats().bytes >= stats.bytes + 4 * 1024) << endl;
+
+  cout << "======== mapped ranges ========" << endl;
+  ostringstream saved12;
+  rint12_ptr->save(saved12);
+  const string image12 = saved12.str();
+  MappedRange<int,string> mapped12;
+  cout << "attached: " << mapped12.attach(image12.data(), image12.size())
+       << ", segments: " << mapped12.segments() << ", actions: " << mapped12.actionCount() << endl;
+  check_mapped(*rint12_ptr, mapped12, 0, 40000);
+  MappedRange<int,string> truncated;
+  cout << "truncated: " << truncated.attach(image12.data(), image12.size() - 1) << endl;
+  MappedRange<short,string> other_keys;
+  cout << "other key type: " << other_keys.attach(image12.data(), image12.size()) << endl;
+  char image_path[] = "/tmp/librange-test-XXXXXX";
+  const int image_fd = mkstemp(image_path);
+  if (image_fd >= 0) {
+    ostringstream saved_bounded;
+    bounded_tree.save(saved_bounded);
+    const string image = saved_bounded.str();
+    const bool written = (write(image_fd, image.data(), image.size()) == (ssize_t)image.size());
+    close(image_fd);
+    MappedRange<int,int> mapped_bounded;
+    cout << "mapped from a file: " << (written && mapped_bounded.open(image_path)) << endl;
+    unlink(image_path);
+    check_mapped(bounded_tree, mapped_bounded, -100, 2000);
+  }
+
+  cout << "======== functor mergers and callbacks ========" << endl;
+  seed = 11;
+  int functor_mismatches = 0, pointer_calls = 0, functor_calls = 0;
+  for (int n = 0; n < 50; ++n) {
+    Range<int,int> a = random_int_range(seed, n % 6, n % 5);
+    Range<int,int> b = random_int_range(seed, n % 5, n % 7);
+    Range<int,int> by_pointer = Range<int,int>::intersect(a, b, &counting_sum, &pointer_calls);
+    Range<int,int> by_functor = Range<int,int>::intersect(a, b, CountingSum(&functor_calls));
+    a.intersectWith(b, CountingSum(&functor_calls));
+    for (int key = -2; key <= 102; ++key)
+      if (by_pointer.find(key) != by_functor.find(key) || by_pointer.find(key) != a.find(key))
+        ++functor_mismatches;
+  }
+  cout << "mismatches: " << functor_mismatches << ", merger calls: " << pointer_calls
+       << " through a pointer, " << functor_calls << " through a functor (twice as many merges)" << endl;
+  Range<int,int> visited = random_int_range(seed, 9, 8);
+  NodeCounts counts;
+  CountRange count_range = { &counts };
+  CountPunct count_punct = { &counts };
+  CountAction count_action = { &counts };
+  visited.traverse(count_range, count_punct, count_action);
+  Range<int,int>::Stats visited_stats = visited.stats();
+  cout << "visited " << counts.ranges << " ranges, " << counts.puncts << " punctuals holding "
+       << counts.entries << ", " << counts.actions << " actions; as counted by stats(): "
+       << (counts.ranges == (int)visited_stats.range_nodes && counts.puncts == (int)visited_stats.punct_nodes
+           && counts.entries == (int)visited_stats.punct_entries && counts.actions == (int)visited_stats.action_nodes) << endl;
+  Range<int,int> scaled = visited;
+  Scale times_ten = { 10, 1 };
+  scaled.changeActions(times_ten);
+  int scale_mismatches = 0;
+  for (int key = -2; key <= 102; ++key)
+    if (scaled.find(key) != 10 * visited.find(key))
+      ++scale_mismatches;
+#if __cplusplus >= 201103L
+  scaled.changeActions([](const int &action) { return action / 10; });
+#else
+  Scale tenth = { 1, 10 };
+  scaled.changeActions(tenth);
+#endif
+  check_same_int(scaled, visited, -2, 102);
+  cout << "scale mismatches: " << scale_mismatches << endl;
+
+  cout << "======== lazy intersections ========" << endl;
+  seed = 13;
+  int lazy_mismatches = 0, lazy_findall_mismatches = 0, lazy_evaluated = 0;
+  int lazy_calls = 0, lookup_calls = 0, evaluation_calls = 0, eager_calls = 0;
+  for (int n = 0; n < 50; ++n) {
+    Range<int,int> a = random_int_range(seed, n % 6, n % 5);
+    Range<int,int> b = random_int_range(seed, n % 5, n % 7);
+    Range<int,int> c = random_int_range(seed, n % 4, n % 3);
+    Range<int,int> eager = Range<int,int>::intersect(Range<int,int>::intersect(a, b, &counting_sum, &eager_calls),
+                                                     c, &sum, NULL);
+    LazyRange<int,int> lazy = Range<int,int>::lazyIntersect(Range<int,int>::lazyIntersect(a, b, CountingSum(&lazy_calls)),
+                                                            c, &sum, NULL);
+    for (int key = -2; key <= 102; key += 7)
+      if (lazy.find(key) != eager.find(key))
+        ++lazy_mismatches;
+    lookup_calls += lazy_calls;
+    lazy_calls = 0;
+    lazy_evaluated += lazy.evaluated();
+    if (lazy.findAll() != Range<int,int>::intersectSweep(Range<int,int>::intersectSweep(a, b, &sum, NULL),
+                                                         c, &sum, NULL).findAll())
+      ++lazy_findall_mismatches;
+    lazy_evaluated += lazy.evaluated();
+    Range<int,int> materialized = lazy.materialize();
+    for (int key = -2; key <= 102; ++key)
+      if (lazy.find(key) != eager.find(key) || materialized.find(key) != eager.find(key))
+        ++lazy_mismatches;
+    evaluation_calls += lazy_calls;
+    lazy_calls = 0;
+  }
+  cout << "mismatches: " << lazy_mismatches << ", findAll() mismatches: " << lazy_findall_mismatches
+       << ", evaluated: " << lazy_evaluated << endl;
+  cout << "inner merger calls: " << lookup_calls << " for 750 lazy lookups and 50 default actions, " << evaluation_calls
+       << " for evaluating them, " << eager_calls << " eager" << endl;
+  LazyRange<int,string> lazy12 = Range<int,string>::lazyIntersect(*rint12_ptr, rint5, &MyTest::mywrapper, NULL);
+  Range<int,string> eager12 = Range<int,string>::intersect(*rint12_ptr, rint5, &MyTest::mywrapper, NULL);
+  cout << "'80' mapped to: '" << lazy12.find(80) << "'" << endl;
+  Range<int,string> materialized12 = lazy12.materialize();
+  int lazy12_mismatches = 0;
+  for (int key = 0; key <= 40000; ++key)
+    if (lazy12.find(key) != eager12.find(key) || materialized12.find(key) != eager12.find(key))
+      ++lazy12_mismatches;
+  cout << "mismatches in [0, 40000]: " << lazy12_mismatches << ", segments: " << materialized12.shape().segments << endl;
+
+  cout << "======== incremental intersections ========" << endl;
+  seed = 17;
+  int view_mismatches = 0, view_calls = 0, eager_view_calls = 0;
+  for (int n = 0; n < 20; ++n) {
+    IntersectionView<int,int,CountingSum> view(random_int_range(seed, n % 6, n % 5),
+                                               random_int_range(seed, n % 5, n % 7), CountingSum(&view_calls));
+    for (int step = 0; step < 20; ++step) {
+      seed = seed * 1103515245 + 12345;
+      const RangeOperator_t op = ((seed >> 20) % 3 ? (RangeOperator_t)((seed >> 8) % 5) : EQUAL);
+      view.addRange((seed >> 4) % 2, op, (seed >> 16) % 100, (seed >> 12) % 8);
+      Range<int,int> eager = Range<int,int>::intersect(view.input(0), view.input(1), &counting_sum, &eager_view_calls);
+      for (int key = -2; key <= 102; ++key)
+        if (view.get().find(key) != eager.find(key))
+          ++view_mismatches;
+    }
+    Scale times_ten = { 10, 1 };
+    view.changeActions(1, times_ten);
+    Range<int,int> eager = Range<int,int>::intersect(view.input(0), view.input(1), &sum, NULL);
+    for (int key = -2; key <= 102; ++key)
+      if (view.get().find(key) != eager.find(key))
+        ++view_mismatches;
+  }
+  // an input painted all over changes its default action, which the
+  // result must follow
+  Range<int,int> below_ten(0), above_ninety(0);
+  below_ten.addRange(LESS_THAN, 10, 1);
+  above_ninety.addRange(GREAT_THAN, 90, 2);
+  IntersectionView<int,int> painted_over(below_ten, above_ninety, &sum, NULL);
+  painted_over.addRange(0, LESS_THAN, 10, 100);
+  painted_over.addRange(0, GREAT_EQUAL_THAN, 10, 100);
+  Range<int,int> painted_eager = Range<int,int>::intersect(painted_over.input(0), painted_over.input(1), &sum, NULL);
+  Range<int,int> painted_result = painted_over.get();
+  check_same_int(painted_result, painted_eager, -2, 102);
+  cout << "actions after painting an input over: " << painted_result.findAll().size()
+       << ", intersecting again: " << painted_eager.findAll().size() << endl;
+  cout << "mismatches: " << view_mismatches << endl;
+  cout << "merger calls for 400 refinements: " << view_calls << " patching, " << eager_view_calls << " intersecting again" << endl;
+
+  cout << "======== rint12_ptr, frozen ========" << endl;
+  FrozenRange<int,string> frozen12 = rint12_ptr->freeze();
+  print_mapping_frozen(frozen12, v_a);
+  print_mapping_frozen(frozen12, v_b);
+  print_mapping_frozen(frozen12, v_c);
+  check_frozen_int(*rint12_ptr, frozen12, 0, 40000);
+  check_batch_int(*rint12_ptr, 0, 40000);
+  check_batch_int(rint5, 0, 40000);
+
+  delete rint10_ptr;
+  delete rint12_ptr;
 }